@@ -93,6 +93,14 @@ std::string undefinedLabel(char* label);
 #define RSTR_OPC 57
 #define DELSTR_OPC 58
 #define STRCAT_OPC 59
+#define MEMCPY_OPC 60
+#define MEMSET_OPC 61
+#define MEMCMP_OPC 62
+#define VADD_OPC 63
+#define VMUL_OPC 64
+#define VSUM_OPC 65
+#define VMIN_OPC 66
+#define VMAX_OPC 67
 
 // Instruction sizes
 #define STOP_SIZE 1
@@ -155,13 +163,22 @@ std::string undefinedLabel(char* label);
 #define RSTR_SIZE 2
 #define DELSTR_SIZE 2
 #define STRCAT_SIZE 2
+#define MEMCPY_SIZE 1
+#define MEMSET_SIZE 1
+#define MEMCMP_SIZE 1
+#define VADD_SIZE 1
+#define VMUL_SIZE 1
+#define VSUM_SIZE 1
+#define VMIN_SIZE 1
+#define VMAX_SIZE 1
 
 // List of mnemonics
 const char* mnems[] = {"stop", "loada", "loadi", "loadr", "loadv", "loadp", "storea", "storer", "storev", "storep", "adda", "addi", "addr", 
 "suba", "subi", "subr", "mula", "muli", "mulr", "diva", "divi", "divr",
 "jz", "jnz", "jl", "jle", "jg", "jge", "jmp", "mod", "push", "pop", "inc", "dec",
 "shl", "shr", "int", "anda", "andi", "andr", "ora", "ori", "orr", "xora", "xori", "xorr",
-"cmpa", "cmpi", "cmpr", "call", "ret", "var", "ptr", "ret", "str", "rstr", "delstr", "strcat"};
+"cmpa", "cmpi", "cmpr", "call", "ret", "var", "ptr", "ret", "str", "rstr", "delstr", "strcat",
+"memcpy", "memset", "memcmp", "vadd", "vmul", "vsum", "vmin", "vmax"};
 
 int mnemLen = sizeof(mnems)/sizeof(mnems[0]);
 
@@ -245,6 +262,15 @@ void CompileToFile(char* sourceFile, std::string output)
 
     ofile << machineCodeString.str().c_str();
     ofile.close();
+
+    // label addresses, the VM profiler uses them to name hot code
+    std::ofstream labelFile(output + ".labels");
+    for(auto &label : labels)
+    {
+        if(label.second != -1)
+            labelFile << label.first << " " << label.second << std::endl;
+    }
+    labelFile.close();
 }
 
 char CheckIfMnemo(char* str)
@@ -621,6 +647,22 @@ int getOpcode(char* mnem)
         return DELSTR_OPC;
     if(strcmp(mnem, "strcat") == 0)
         return STRCAT_OPC;
+    if(strcmp(mnem, "memcpy") == 0)
+        return MEMCPY_OPC;
+    if(strcmp(mnem, "memset") == 0)
+        return MEMSET_OPC;
+    if(strcmp(mnem, "memcmp") == 0)
+        return MEMCMP_OPC;
+    if(strcmp(mnem, "vadd") == 0)
+        return VADD_OPC;
+    if(strcmp(mnem, "vmul") == 0)
+        return VMUL_OPC;
+    if(strcmp(mnem, "vsum") == 0)
+        return VSUM_OPC;
+    if(strcmp(mnem, "vmin") == 0)
+        return VMIN_OPC;
+    if(strcmp(mnem, "vmax") == 0)
+        return VMAX_OPC;
     return 999;
 }
 
@@ -748,5 +790,21 @@ int getOpSize(char* mnem)
         return DELSTR_SIZE;
     if(strcmp(mnem, "strcat") == 0)
         return STRCAT_SIZE;
+    if(strcmp(mnem, "memcpy") == 0)
+        return MEMCPY_SIZE;
+    if(strcmp(mnem, "memset") == 0)
+        return MEMSET_SIZE;
+    if(strcmp(mnem, "memcmp") == 0)
+        return MEMCMP_SIZE;
+    if(strcmp(mnem, "vadd") == 0)
+        return VADD_SIZE;
+    if(strcmp(mnem, "vmul") == 0)
+        return VMUL_SIZE;
+    if(strcmp(mnem, "vsum") == 0)
+        return VSUM_SIZE;
+    if(strcmp(mnem, "vmin") == 0)
+        return VMIN_SIZE;
+    if(strcmp(mnem, "vmax") == 0)
+        return VMAX_SIZE;
     return 999;
 }
\ No newline at end of file
@@ -16,11 +16,31 @@ void Clock::Update()
     //this->ui.Update();
     while(isOn)
     {
-        activeProgram = cpu.ExecuteProgram(activeProgram, 1);
+        // Run whole quanta, only stepping out of the interpreter when something needs the clock
+        CpuEvent event = cpu.Run(step ? 1 : cpu.scheduler.quantum);
         //this->ui.cpu = cpu;
-        if(!((cpu.SaveToSnapshot().fs & (1 << 3)) == 0))
+        if(event == EVENT_BLOCK && saveSnapshot && cpu.blockingEvents == 0)
+        {
+            cpu.SaveMachine();
+            std::cout << "Machine snapshot saved to " << SNAPSHOT_FILE << std::endl;
+        }
+        if(event == EVENT_BLOCK || event == EVENT_FAULT)
+        {
+            cpu.ServiceEvent(event);
+        }
+        else if(event == EVENT_BUDGET)
+        {
+            cpu.Preempt();
+        }
+        else if(event == EVENT_HALT)
         {
             std::cout << "Program has finished!";
+            PrintStats();
+            if(cpu.profiling)
+                cpu.SaveProfiles();
+#ifdef GUEST_PROFILER
+            cpu.profiler.WriteReport();
+#endif
 
             isOn = false;
         }        
@@ -32,13 +52,38 @@ void Clock::Start()
 {
     InitSwapDisk();
     //this->ui = ui;
-    std::cout << "Loading bootloader...\n";
-    activeProgram = cpu.LoadProgram("bootloader"); 
-    std::cout << "Bootloader is loaded, executing...\n";
+    if(restoreSnapshot && cpu.RestoreMachine())
+    {
+        std::cout << "Machine restored from " << SNAPSHOT_FILE << std::endl;
+    }
+    else
+    {
+        std::cout << "Loading bootloader...\n";
+        cpu.EnterProgram(cpu.LoadProgram("bootloader"));
+        std::cout << "Bootloader is loaded, executing...\n";
+    }
+    bootTime = std::chrono::steady_clock::now();
     //this->ui.cpu = cpu;
 }
 
+void Clock::PrintStats()
+{
+    // Time spent waiting for input is not counted towards the instruction rate
+    double running = std::chrono::duration<double>(std::chrono::steady_clock::now() - bootTime - cpu.blockedTime).count();
+    double bootToShell = 0;
+    if(cpu.blockingEvents > 0)
+        bootToShell = std::chrono::duration<double, std::milli>(cpu.firstBlock - bootTime).count();
+    std::cout << "\nBoot to shell: " << bootToShell << " ms, "
+              << cpu.instructionsRetired << " instructions, "
+              << (running > 0 ? cpu.instructionsRetired / running : 0) << " instructions/s\n";
+    std::cout << "Page replacement (" << cpu.memcontroller.ReplacementPolicyName() << "): "
+              << cpu.memcontroller.pageHits << " hits, "
+              << cpu.memcontroller.pageFaults << " faults, "
+              << cpu.memcontroller.swapOuts << " swap outs, "
+              << cpu.memcontroller.prefetchedPages << " prefetched\n";
+}
+
 void Clock::InitSwapDisk()
 {
     iocontrol.InitDisk();
-}
\ No newline at end of file
+}
@@ -43,6 +43,63 @@ std::array<int, PAGE_SIZE> IOControl::ReadSwapData(int frameNumber)
     return resultRwData->data;
 }
 
+std::array<int, PAGE_SIZE> IOControl::PeekSwapData(int frameNumber)
+{
+    rwSwapData rwData = {frameNumber, {0}};
+    PeekSwapDataInternal(&rwData);
+    return rwData.data;
+}
+
+void IOControl::StartSwapRead(int frameNumber)
+{
+    if(SwapReadStarted(frameNumber))
+        return;
+
+    rwSwapData &rwData = pendingData[frameNumber];
+    rwData = {frameNumber, {0}};
+    pthread_t readThread;
+    if(pthread_create(&readThread, NULL, PeekSwapDataInternal, (void*)&rwData) != 0)
+    {
+        pendingData.erase(frameNumber);
+        return;
+    }
+    pendingReads[frameNumber] = readThread;
+}
+
+std::array<int, PAGE_SIZE> IOControl::FinishSwapRead(int frameNumber)
+{
+    pthread_join(pendingReads[frameNumber], NULL);
+    std::array<int, PAGE_SIZE> data = pendingData[frameNumber].data;
+    pendingReads.erase(frameNumber);
+    pendingData.erase(frameNumber);
+    return data;
+}
+
+void IOControl::DiscardSwapData(int frameNumber)
+{
+    std::string swapName = DISK_DIRECTORY + std::to_string(frameNumber);
+    pthread_mutex_lock(&swapMutex);
+    int status = remove(swapName.c_str());
+    pthread_mutex_unlock(&swapMutex);
+    if(status == -1)
+    {
+        std::perror("Could not remove swap file.");
+    }
+}
+
+void *(IOControl::PeekSwapDataInternal)(void *arg)
+{
+    rwSwapData *rwData = (rwSwapData*)arg;
+    std::string swapName = DISK_DIRECTORY + std::to_string(rwData->frameNumber);
+
+    pthread_mutex_lock(&swapMutex);
+    std::ifstream disk(swapName);
+    for(int i = 0; i < PAGE_SIZE && (disk >> rwData->data[i]); i++);
+    disk.close();
+    pthread_mutex_unlock(&swapMutex);
+    return rwData;
+}
+
 void *(IOControl::WriteSwapDataInternal)(void* arg)
 {
     rwSwapData *rwData = (rwSwapData*)arg;
@@ -137,6 +194,10 @@ std::fstream& IOControl::GotoLine(std::fstream& file, int lineNum)
 
 std::vector<int> IOControl::FindProgramCode(std::string programName, int keywordToSearch)
 {
+    auto image = programImages.find({programName, keywordToSearch});
+    if(image != programImages.end())
+        return image->second;
+
     auto driveData = readAllDriveData();
 
     int targetCodeLocation = -1;
@@ -176,6 +237,7 @@ std::vector<int> IOControl::FindProgramCode(std::string programName, int keyword
             break;
     }   
 
+    programImages[{programName, keywordToSearch}] = code;
     return code;
 }
 
@@ -198,8 +260,11 @@ std::vector<int> IOControl::readAllDriveData()
     return driveData;
 }
 
+// Every change to the drive (new, deleted or renamed files) is written here
 bool IOControl::modifyDriveData(std::vector<int> newData)
 {
+    programImages.clear();
+    driveGeneration++;
     std::ofstream file;
     file.open(DRIVE, std::ofstream::out | std::ofstream::trunc);
     int s = 5000;
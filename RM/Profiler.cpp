@@ -0,0 +1,95 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+static const char *opcodeNames[] = {
+    "stop", "loada", "loadi", "loadr", "storea", "storer", "adda", "addi", "addr",
+    "suba", "subi", "subr", "mula", "muli", "mulr", "diva", "divi", "divr",
+    "jz", "jnz", "jl", "jle", "jg", "jge", "jmp", "mod", "push", "pop", "inc", "dec",
+    "shl", "shr", "int", "anda", "andi", "andr", "ora", "ori", "orr", "xora", "xori", "xorr",
+    "cmpa", "cmpi", "cmpr", "call", "var", "ptr", "loadv", "loadp", "storep", "storev",
+    "jo", "jp", "jc", "ret", "str", "rstr", "delstr", "strcat",
+    "memcpy", "memset", "memcmp", "vadd", "vmul", "vsum", "vmin", "vmax"
+};
+
+GuestProfile &Profiler::For(const std::string &name)
+{
+    return profiles[name.size() > 0 ? name : "unnamed"];
+}
+
+// Labels come from the '<program>.labels' file the compiler writes next to the program
+std::map<int, std::string> Profiler::ReadLabels(const std::string &name)
+{
+    std::map<int, std::string> labels;
+    std::ifstream file(name + ".labels");
+    std::string label;
+    int address;
+    while(file >> label >> address)
+    {
+        labels[address] = label;
+    }
+    return labels;
+}
+
+// Names pc after the closest label at or before it
+std::string Profiler::Locate(const std::map<int, std::string> &labels, int pc)
+{
+    auto label = labels.upper_bound(pc);
+    if(label == labels.begin())
+        return "";
+    label--;
+    if(label->first == pc)
+        return label->second;
+    return label->second + "+" + std::to_string(pc - label->first);
+}
+
+void Profiler::WriteReport(std::string filename)
+{
+    std::ofstream report(filename);
+
+    for(auto &entry : profiles)
+    {
+        const GuestProfile &profile = entry.second;
+        auto labels = ReadLabels(entry.first);
+        report << entry.first << ": " << profile.instructions << " instructions" << std::endl;
+
+        std::vector<std::pair<long long, int>> opcodes;
+        for(size_t i = 0; i < profile.opcodes.size(); i++)
+        {
+            if(profile.opcodes[i] > 0)
+                opcodes.push_back({profile.opcodes[i], i});
+        }
+        std::sort(opcodes.rbegin(), opcodes.rend());
+        report << "  opcodes:" << std::endl;
+        for(auto &opcode : opcodes)
+        {
+            int count = sizeof(opcodeNames) / sizeof(opcodeNames[0]);
+            std::string name = opcode.second < count ? opcodeNames[opcode.second] : std::to_string(opcode.second);
+            report << "    " << name << " " << opcode.first << std::endl;
+        }
+
+        std::vector<std::pair<long long, int>> pcs;
+        for(size_t i = 0; i < profile.pcs.size(); i++)
+        {
+            if(profile.pcs[i] > 0)
+                pcs.push_back({profile.pcs[i], i});
+        }
+        std::sort(pcs.rbegin(), pcs.rend());
+        if(pcs.size() > PROFILE_TOP_PCS)
+            pcs.resize(PROFILE_TOP_PCS);
+        report << "  hottest addresses:" << std::endl;
+        for(auto &pc : pcs)
+        {
+            report << "    " << pc.second << " " << Locate(labels, pc.second) << " " << pc.first << std::endl;
+        }
+
+        report << "  jumps (taken / not taken):" << std::endl;
+        for(auto &jump : profile.jumps)
+        {
+            report << "    " << jump.first << " " << Locate(labels, jump.first) << " "
+                << jump.second.first << " / " << jump.second.second << std::endl;
+        }
+        report << std::endl;
+    }
+}
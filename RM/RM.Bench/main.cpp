@@ -0,0 +1,106 @@
+#include "cpu.h"
+#include <chrono>
+#include <iostream>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Runs every given compiled program with every execution engine and reports guest MIPS.
+// Programs are restarted from the beginning until enough instructions have been retired.
+// Usage: rmBench <compiled program> [<compiled program> ...]
+
+#define BENCH_INSTRUCTIONS 20000000
+#define BENCH_SECONDS 2.0
+
+struct BenchResult
+{
+    long long instructions;
+    double seconds;
+    std::string error;
+};
+
+BenchResult RunBenchmark(std::string filename, ExecutionEngine engine)
+{
+    BenchResult result = {0, 0, ""};
+
+    HeapBlockHandlers.clear();
+    processList.clear();
+
+    Cpu cpu = Cpu();
+    cpu.engine = engine;
+    Program program = cpu.LoadProgram(filename);
+
+    // Slices start small so programs doing drive I/O in a loop still respect the time
+    // limit, and grow while they are cheap so ExecuteProgram entry does not dominate
+    int slice = 1000;
+    auto begin = std::chrono::steady_clock::now();
+    try
+    {
+        while(cpu.instructionsRetired < BENCH_INSTRUCTIONS && result.seconds < BENCH_SECONDS)
+        {
+            // a finished program has given its pages back, so it is loaded again
+            if((program.cpuSnapshot.fs & ef) != 0)
+                program = cpu.LoadProgram(filename);
+            program = cpu.ExecuteProgram(program, slice);
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            if(seconds - result.seconds < 0.01 && slice < 1000000)
+                slice *= 2;
+            result.seconds = seconds;
+        }
+    }
+    catch(std::exception &error)
+    {
+        result.error = error.what();
+    }
+    catch(std::exception *error)
+    {
+        result.error = error->what();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result.instructions = cpu.instructionsRetired;
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        std::cout << "Usage: rmBench <compiled program> [<compiled program> ...]" << std::endl;
+        return 1;
+    }
+
+    ExecutionEngine engines[] = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT};
+    const char* engineNames[] = {"switch", "threaded", "jit"};
+    const int engineCount = sizeof(engines)/sizeof(engines[0]);
+
+    // Guest programs print through int 10, keep that out of the report,
+    // and reading a line through int 5 should not block the benchmark
+    freopen("/dev/null", "r", stdin);
+    fflush(stdout);
+    int reportFd = dup(STDOUT_FILENO);
+    int nullFd = open("/dev/null", O_WRONLY);
+
+    for(int i = 1; i < argc; i++)
+    {
+        for(int e = 0; e < engineCount; e++)
+        {
+            dup2(nullFd, STDOUT_FILENO);
+            BenchResult result = RunBenchmark(argv[i], engines[e]);
+            fflush(stdout);
+            dup2(reportFd, STDOUT_FILENO);
+
+            double mips = result.instructions / result.seconds / 1000000.0;
+            printf("%-24s %-9s %12lld instructions %8.3f s %10.2f MIPS", argv[i], engineNames[e],
+                result.instructions, result.seconds, mips);
+            if(result.error.size() > 0)
+                printf("  (stopped: %s)", result.error.c_str());
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    close(nullFd);
+    close(reportFd);
+    return 0;
+}
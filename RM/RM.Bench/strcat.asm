@@ -0,0 +1,20 @@
+str x
+storer x
+var n
+loadi 10000
+storev n
+
+label build
+strcat x
+storer x
+loadv n
+dec
+storev n
+jz done
+jmp build
+
+label done
+loadr x
+int 10
+delstr 0
+stop
@@ -4,11 +4,14 @@
 #include "memcontrol.h"
 #include "IOControl.h"
 #include "UI.h"
+#include <chrono>
 
 class Clock
 {
     public:
         bool isOn;
+        bool saveSnapshot = false; // dump the machine when it first waits for input (the shell prompt)
+        bool restoreSnapshot = false; // start from the dump instead of booting, if there is one
 
         Clock(Cpu cpu, bool step);
         void Update();
@@ -17,9 +20,10 @@ class Clock
         Cpu cpu;
         Memcontrol memcontrol;
         IOControl iocontrol;
-        Program activeProgram;
+        std::chrono::steady_clock::time_point bootTime;
 
         void InitSwapDisk();
+        void PrintStats();
        // UI ui = UI();
         bool step;
 };
\ No newline at end of file
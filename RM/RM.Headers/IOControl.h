@@ -1,8 +1,11 @@
 #pragma once
 
 #include <array>
+#include <map>
 #include <vector>
 #include <semaphore.h>
+#include <string>
+#include <fstream>
 #include "SizeDefinitions.h"
 
 #define DRIVE "drive"
@@ -16,6 +19,10 @@ typedef struct rwSwapData
     std::array<int, PAGE_SIZE> data;
 } rwSwapData;
 
+// Program code found on the drive by name and type, dropped whenever the drive is written
+inline std::map<std::pair<std::string, int>, std::vector<int>> programImages;
+inline long long driveGeneration = 0; // bumped by every write to the drive
+
 inline std::array<char, CHAR_BUFFER_SIZE> charBuffer; 
 inline std::array<char, CHAR_BUFFER_SIZE> tempCharBuffer; 
 
@@ -28,6 +35,14 @@ class IOControl
         //These things should be launched in threads
         void WriteSwapData(int frameNumber, std::array<int, PAGE_SIZE> data);
         std::array<int, PAGE_SIZE> ReadSwapData(int frameNumber); // returns an array of data from a disk
+        std::array<int, PAGE_SIZE> PeekSwapData(int frameNumber); // same, but the sector stays on the disk
+
+        // Reads of a sector left running in the background, FinishSwapRead waits
+        // for one and hands over what it read. The sector stays on the disk
+        void StartSwapRead(int frameNumber);
+        bool SwapReadStarted(int frameNumber) const { return pendingReads.count(frameNumber) != 0; }
+        std::array<int, PAGE_SIZE> FinishSwapRead(int frameNumber);
+        void DiscardSwapData(int frameNumber); // removes the sector once its data went back to memory
 
 
         void PrintCharBuffer();
@@ -43,7 +58,11 @@ class IOControl
         std::vector<int> FindProgramCode(std::string programName, int keywordToSearch);
         std::vector<std::vector<int>> SplitDriveDataIntoProgramPieces();
     private:
+        std::map<int, pthread_t> pendingReads;
+        std::map<int, rwSwapData> pendingData; // kept apart from the threads, the read threads fill them
+
         static void* WriteSwapDataInternal(void* arg);
+        static void* PeekSwapDataInternal(void* arg);
         static void* ReadSwapDataInternal(void* arg); // returns an array of data from a disk
         bool DriveExists();
         std::fstream& GotoLine(std::fstream& file, int lineNum);
@@ -0,0 +1,58 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+// Counting what guest programs execute is compiled in only with GUEST_PROFILER
+// defined ('make profile'), otherwise the interpreter has no profiling code at all
+#ifdef GUEST_PROFILER
+#define GUEST_PROFILING 1
+#else
+#define GUEST_PROFILING 0
+#endif
+
+#define PROFILE_REPORT "profile.txt" // written when the machine halts
+#define PROFILE_TOP_PCS 20 // hottest addresses listed per program
+
+struct GuestProfile
+{
+    long long instructions = 0;
+    std::vector<long long> opcodes; // executions per opcode
+    std::vector<long long> pcs; // executions per code address
+    std::map<int, std::pair<long long, long long>> jumps; // pc -> times taken, not taken
+};
+
+// Guest profiles by program name, programs with the same name are counted together
+class Profiler
+{
+    public:
+        GuestProfile &For(const std::string &name);
+
+        inline void Count(GuestProfile &profile, int pc, int opcode)
+        {
+            if((size_t)opcode >= profile.opcodes.size())
+                profile.opcodes.resize(opcode + 1);
+            if((size_t)pc >= profile.pcs.size())
+                profile.pcs.resize(pc + 1);
+            profile.instructions++;
+            profile.opcodes[opcode]++;
+            profile.pcs[pc]++;
+        }
+
+        inline void CountJump(GuestProfile &profile, int pc, bool taken)
+        {
+            auto &outcome = profile.jumps[pc];
+            if(taken)
+                outcome.first++;
+            else
+                outcome.second++;
+        }
+
+        void WriteReport(std::string filename = PROFILE_REPORT);
+
+    private:
+        std::map<std::string, GuestProfile> profiles;
+
+        std::map<int, std::string> ReadLabels(const std::string &name);
+        std::string Locate(const std::map<int, std::string> &labels, int pc);
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include "SizeDefinitions.h"
+
+#define REPLACEMENT_K 2 // references after which LRU-K treats a page as frequently used
+
+enum ReplacementKind
+{
+    REPLACE_CLOCK, // second chance, the default
+    REPLACE_LRU2,
+    REPLACE_ARC
+};
+
+// Chooses which resident page goes to swap. A page is resident while it holds
+// a frame of its own and is not on disk, shared frames are never given out.
+// References come from TLB misses and flushes, so a page hit many times through
+// a cached translation counts once per flush. Pages live in circular lists
+// linked through per page arrays, which makes every move O(1) and keeps the
+// policy copyable along with its Memcontrol.
+class ReplacementPolicy
+{
+    public:
+        ReplacementPolicy();
+        ReplacementKind kind = REPLACE_CLOCK;
+
+        void Reset(); // forgets every page, the kind stays
+        void Inserted(int page); // page became resident, nothing happens if it already was
+        void Removed(int page, bool swapped); // swapped pages are remembered by ARC and LRU-K
+        void Referenced(int page);
+        int Victim(const std::bitset<PAGETABLE_SIZE> &pinned); // least valuable resident page not pinned, -1 if there is none
+        const char *Name() const;
+
+    private:
+        enum
+        {
+            RECENT,   // CLOCK ring, LRU-K pages with fewer than K references, ARC T1
+            FREQUENT, // LRU-K pages with K references, ARC T2
+            GHOST_RECENT, // ARC B1
+            GHOST_FREQUENT, // ARC B2
+            LIST_COUNT,
+            NO_LIST = -1
+        };
+
+        std::array<int, PAGETABLE_SIZE> prev;
+        std::array<int, PAGETABLE_SIZE> next;
+        std::array<int, PAGETABLE_SIZE> listOf;
+        std::array<int, PAGETABLE_SIZE> references; // CLOCK reference bit, LRU-K count up to REPLACEMENT_K
+        std::array<int, LIST_COUNT> heads; // least recently used page of each list, the hand for CLOCK
+        std::array<int, LIST_COUNT> sizes;
+        int target = 0; // ARC share of the frames that T1 aims for
+
+        void Link(int page, int list); // at the most recently used end
+        void Unlink(int page);
+        int FirstUnpinned(int list, const std::bitset<PAGETABLE_SIZE> &pinned);
+        int ClockVictim(const std::bitset<PAGETABLE_SIZE> &pinned);
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include <deque>
+#include <map>
+#include <vector>
+
+#define DEFAULT_QUANTUM 100000 // instructions a process runs before the next ready one gets the cpu
+#define NO_PROCESS -2 // returned by Next when nothing is ready, -1 is the bootloader
+
+// Round-robin scheduling of processes by id. The program started by the
+// clock runs outside of processList with id -1 and is scheduled like any other.
+class Scheduler
+{
+    public:
+        int quantum = DEFAULT_QUANTUM;
+
+        void Add(int id); // id becomes ready, it runs after everything already waiting in the queue
+        int Next(); // takes the next ready id off the queue, NO_PROCESS if there is none
+        int Peek() const; // the id Next would return, without taking it
+        bool HasReady();
+        void Wait(int id, int child); // id stays off the queue until child exits
+        void Exited(int id); // processes waiting for id become ready
+        void Clear();
+
+        // For machine snapshots
+        std::vector<int> Ready() const { return std::vector<int>(runQueue.begin(), runQueue.end()); }
+        const std::map<int, std::vector<int>> &Waiting() const { return waiting; }
+
+    private:
+        std::deque<int> runQueue;
+        std::map<int, std::vector<int>> waiting; // child id -> ids waiting for it
+};
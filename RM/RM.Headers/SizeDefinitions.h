@@ -4,13 +4,20 @@
 #define VRAM_SIZE 2097152
 #define PAGETABLE_SIZE 512 // 512 pages 4kb each 
 #define FRAMETABLE_SIZE 256 // 256 frames of physical memory
-#define HEAP_START RAM_SIZE - 314000
+#define HEAP_SIZE 314000 // words from HEAP_START to the end of RAM
+#define HEAP_START (RAM_SIZE - HEAP_SIZE)
+#define HEAP_CLASSES 20 // free lists, class k holds free blocks of 2^k to 2^(k+1)-1 words
+#define HEAP_MIN_SPLIT 4 // smallest remainder worth splitting off a free block
+#define TLB_SIZE 64 // entries of the software TLB in front of the page table, a power of two
+#define SPARE_PAGE_RESERVE 16 // pages without a frame that sharing memory leaves for swapping
+#define PREFETCH_PAGES 32 // most pages of a working set read from swap ahead of a switch
 
 
 #define DISK_NAME "devDrv.txt"
 #define DISK_DIRECTORY "swapdisk/"
 #define DISK_SIZE 1048576
 #define PAGE_SIZE 4096
+#define SEGMENT_PAGE_WORDS (PAGE_SIZE - 1) // words of a page a segment addresses, the last one is left out
 #define SECTOR_SIZE 4096
 #define SECTOR_COUNT 1048576 / SECTOR_SIZE
 #define CHAR_BUFFER_SIZE 4096 // amount of characters that can be displayed
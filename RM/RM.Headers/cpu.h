@@ -1,8 +1,15 @@
 #pragma once 
 #include <string>
 #include <array>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
 #include "FileSys.h"
 #include "memcontrol.h"
+#include "jit.h"
+#include "Scheduler.h"
+#include "Profiler.h"
 
 
 // Flag definition
@@ -17,19 +24,211 @@ enum
     pf = 1 << 6  // parity
 };
 
+// Flag-setting result that has not been folded into fs yet
+enum PendingFlags
+{
+    FLAGS_NONE,
+    FLAGS_RESULT, // sf, zf and pf of flagResult
+    FLAGS_COMPARE // lf, zf and pf of comparing flagResult with flagOperand
+};
+
+// Instruction definition
+enum
+{
+    STOP = 0,
+    LOADA,
+    LOADI,
+    LOADR,
+    STOREA,
+    STORER,
+    ADDA,
+    ADDI,
+    ADDR,
+    SUBA,
+    SUBI,
+    SUBR,
+    MULA,
+    MULI,
+    MULR,
+    DIVA,
+    DIVI,
+    DIVR,
+    JZ,
+    JNZ,
+    JL,
+    JLE,
+    JG,
+    JGE,
+    JMP,
+    MOD,
+    PUSH,
+    POP,
+    INC,
+    DEC,
+    SHL,
+    SHR,
+    INT,
+    ANDA,
+    ANDI,
+    ANDR,
+    ORA,
+    ORI,
+    ORR,
+    XORA,
+    XORI,
+    XORR,
+    CMPA,
+    CMPI,
+    CMPR,
+    CALL,
+    VAR,
+    PTR,
+    LOADV,
+    LOADP,
+    STOREP,
+    STOREV,
+    JO,
+    JP,
+    JC,
+    RET,
+    STR,
+    RSTR,
+    DELSTR,
+    STRCAT,
+    MEMCPY, // acc words from the address in c to the address in x
+    MEMSET, // acc words at the address in x set to c
+    MEMCMP, // acc words at x and c compared, acc is -1, 0 or 1 afterwards
+    VADD,   // acc words at x each get the word at the same place from c added
+    VMUL,   // same as VADD, multiplied
+    VSUM,   // acc becomes the sum of acc words at x
+    VMIN,   // acc becomes the smallest of acc words at x
+    VMAX    // acc becomes the largest of acc words at x
+};
+
+// A single instruction as the execution loop sees it: the opcode together with
+// its operand word and the pc of the following instruction, so running code
+// never has to go through address translation
+struct DecodedInstruction
+{
+    int opcode;
+    int operand; // for STR/STRCAT this is an index into DecodedProgram::strings
+    int nextPc;
+    int fused = 0; // Superinstruction starting at this instruction, FUSED_NONE if there is none
+    int fusedLength = 0; // instructions covered by the superinstruction
+};
+
+// Superinstructions the loader puts over runs of instructions, each runs the
+// whole run in a single dispatch. Only the entry at the start of the run changes,
+// so jumping into the middle of a run still executes the plain instructions.
+enum Superinstruction
+{
+    FUSED_NONE = 0,
+    FUSED_VALUE_INTERRUPT, // str or loadv / storer / int
+    FUSED_COMPARE_BRANCH   // loadi / cmpr / jz or jnz
+};
+
+// Counters read with int 37, acc selects one and gets its value
+enum
+{
+    COUNTER_INSTRUCTIONS = 0, // retired by the machine
+    COUNTER_PROCESS_CYCLES,   // instructions run by the current process
+    COUNTER_PAGE_FAULTS,
+    COUNTER_SWAP_INS,
+    COUNTER_SWAP_OUTS,
+    COUNTER_HEAP_BYTES,       // allocated on the heap so far
+    COUNTER_PAGE_HITS         // translations that found their page in memory
+};
+
+#define SNAPSHOT_FILE "machine.snap"
+#define SNAPSHOT_MAGIC 0x534d5221 // "!RMS"
+#define SNAPSHOT_VERSION 5
+
+// Code segment translated once into DecodedInstructions, indexed by pc
+struct DecodedProgram
+{
+    std::vector<DecodedInstruction> instructions;
+    std::vector<std::string> strings;
+    std::vector<int> pages;        // code pages this image was decoded from
+    std::vector<int> pageVersions; // page versions at decode time, used for invalidation
+    std::vector<const void*> threadedCode; // handler per instruction, filled by the threaded engine
+    std::vector<const void*> jitThreadedCode; // threadedCode with the JIT's block heads checked first
+    std::shared_ptr<JitImage> jitImage; // compiled blocks, shared by copies of the image
+    std::string name; // program name, its profile is kept in <name>.profile
+    long long driveGeneration = -1; // drive generation the code was read at, -1 if it did not come from the drive
+    std::map<std::pair<int, int>, long long> pairCounts; // opcode pairs executed while profiling
+    int previousOpcode = -1;
+};
+
+// Execution engines, the switch engine is kept as a reference implementation
+enum ExecutionEngine
+{
+    ENGINE_SWITCH,
+    ENGINE_THREADED,
+    ENGINE_JIT // compiles hot blocks, the threaded engine is used where the JIT is unavailable
+};
+
+// Reasons for Run to hand control back to its caller
+enum CpuEvent
+{
+    EVENT_BUDGET, // the instruction budget ran out
+    EVENT_STOP,   // a process stopped, execution continues in its parent
+    EVENT_HALT,   // the end flag is set
+    EVENT_BLOCK,  // the next instruction waits for input and has not been executed
+    EVENT_FAULT   // a page was out in swap, the instruction is restarted after ServiceEvent
+};
+
+// Labels of the threaded engine, they only exist inside RunThreaded
+struct ThreadedHandlers
+{
+    const void *const *opcodes;
+    int opcodeCount;
+    const void *undefined;
+    const void *fused;
+    const void *jitHead; // nullptr when block heads are not checked
+};
+
+// What the threaded engine dispatches through, until the next out of line handler
+struct ThreadedTables
+{
+    const DecodedInstruction *instructions;
+    const void *const *code;
+    const void *const *plainCode; // code without the block head checks
+    int instructionCount;
+    JitImage *image; // nullptr when block heads are not checked
+};
+
 class Cpu
 {
+    friend class RmTest; // looks at the decoded and compiled images
+
     public:
         Memcontrol memcontroller = Memcontrol();
         IOControl iocontroller = IOControl();
         FileSystem filesystem = FileSystem();
-        Program activeProgram;
+        Program activeProgram; // the running process keeps its program here, its processList entry is empty meanwhile
+        Scheduler scheduler = Scheduler();
+        ExecutionEngine engine = JIT_SUPPORTED ? ENGINE_JIT : ENGINE_THREADED;
+        long long instructionsRetired = 0;
+        bool profiling = false; // record opcode pairs for superinstruction fusion, runs on the switch engine
+#ifdef GUEST_PROFILER
+        Profiler profiler; // per program counts of opcodes, addresses and jump outcomes
+#endif
+        long long blockingEvents = 0;
+        std::chrono::steady_clock::time_point firstBlock; // when a program first waited for input
+        std::chrono::steady_clock::duration blockedTime = std::chrono::steady_clock::duration::zero();
 
         Cpu(){}
         void ShowRam(); // Show the contents of the RAM
         Program LoadProgram(std::string filename);// Load the Program machine code to the memory
-        Program LoadProgram(std::vector<int> programCode);// Load the Program machine code to the memory
+        Program LoadProgram(std::vector<int> programCode, std::string name = "");// Load the Program machine code to the memory
         Program ExecuteProgram(Program program, int cycles = 14800); // Execute the loaded program for some cycles
+        void EnterProgram(Program program); // Make the program active without running it
+        CpuEvent Run(int budget, int *executed = nullptr); // Run the active program until an event or the budget runs out
+        void ServiceEvent(CpuEvent event); // Resolve a blocking or faulting event returned by Run
+        void SaveProfiles(); // Add the recorded opcode pairs to the profile of every named program
+        void Preempt(); // Give the cpu to the next ready process, if there is one
+        void SaveMachine(std::string filename = SNAPSHOT_FILE); // Dump memory, swap, processes and registers
+        bool RestoreMachine(std::string filename = SNAPSHOT_FILE); // Continue from a dump, false if there is none
         CpuSnapshot SaveToSnapshot();
         Program LoadBootloader();
         void SetFromSnapshot(CpuSnapshot snapshot);
@@ -46,11 +245,45 @@ class Cpu
         int cReg = 0x0; // c register
         int retReg = 0x0; // return register used in calls
 
+        // Flags are sticky, so only the newest result can be pending, older ones are already in fs
+        int flagKind = FLAGS_NONE;
+        int flagResult = 0;
+        int flagOperand = 0;
+
+
+        // Decoded code segments, keyed by the first page of the code segment
+        std::map<int, DecodedProgram> decodedPrograms;
+        DecodedProgram *decoded = nullptr;
+        std::map<std::pair<std::string, int>, int> loadedPrograms; // newest image launched from the drive, by name and keyword
+        const DecodedInstruction *current = nullptr;
+
+        Program bootContext; // program started outside of processList while a process runs
+        int runExecuted = 0; // instructions retired by the Run in progress
+        long long contextStart = 0; // instructions retired when the active program got the cpu
+        std::vector<int> faultedPages; // brought in for the instruction being restarted, kept in memory until it completes
 
         void Fetch();
         void Decode();
+        void SwitchTo(int id);
+        Program &ContextProgram(int id);
+        long long ReadCounter(int counter);
+        CpuEvent RunSwitch(int cycles, int &c);
+        CpuEvent RunThreaded(int cycles, int &c, bool jitHeads = false);
+        ThreadedTables PrepareThreadedCode(const ThreadedHandlers &handlers, JitImage *prepared);
+        CpuEvent RunJit(int cycles, int &c);
+
+        DecodedProgram DecodeProgram(const std::vector<int> &code);
+        DecodedProgram *GetDecodedProgram(const Program &program);
+        void CacheDecodedProgram(const Program &program, DecodedProgram image);
+        void FuseSuperinstructions(DecodedProgram &image);
+        void ExecuteFused();
+        bool IsDecodedProgramValid(const DecodedProgram &image, const Program &program);
+        const DecodedProgram *FindLoadedProgram(const std::string &name, int keyword);
+        std::vector<int> ReadCodeSegment(const Program &program);
 
         void OP_STOP();
+        void EndCurrentProcess();
+        void KillCurrentProcess(OutOfMemory *error);
 
         // Loads
         void OP_LOADA(); // load value at address
@@ -143,12 +376,22 @@ class Cpu
         void OP_RSTR();
         void OP_DELSTR();
         void OP_STRCAT();
+        void OP_MEMCPY();
+        void OP_MEMSET();
+        void OP_MEMCMP();
+        void OP_VADD();
+        void OP_VMUL();
+        void OP_VSUM();
+        void OP_VMIN();
+        void OP_VMAX();
 
         std::string buildString();
 
         int AddInternal(int x, int y);
         int MulInternal(int x, int y);
-        bool ParityCheck();
+        void UpdateFlags();
+        void UpdateCompareFlags(uint16_t val);
+        void MaterializeFlags(); // fold the pending result into fs, needed before fs is read
 
         void int3();  // Load program from disk
         void int4();  // Execute kernel process by Id
@@ -165,4 +408,5 @@ class Cpu
         void int33(); // get process info string
         void int35(); // get count of args
         void int36(); // get arg by given index
+        void int37(); // read a performance counter
 };
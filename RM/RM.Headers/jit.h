@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define JIT_BUFFER_SIZE (4 << 20) // bytes of executable memory for compiled blocks
+#define JIT_HOT_THRESHOLD 8 // times a pc is interpreted before a block is compiled there
+#define JIT_MAX_BLOCK 64 // instructions in a single compiled block
+#define JIT_MIN_BLOCK 4 // shorter blocks stay with the interpreter unless they loop
+
+struct DecodedInstruction;
+
+// Guest state as the compiled code sees it, copied in and out around every entry
+struct JitFrame
+{
+    int *ram;
+    const void *const *entries; // compiled block per pc, used for RET
+    long long budget; // instructions left, counted down per block
+    int entryCount;
+    int acc;
+    int fs;
+    int retReg;
+    int xReg;
+    int cReg;
+    int pc;
+    int addr;
+    int ir;
+};
+
+// Compiled code for one decoded program
+struct JitImage
+{
+    int generation = -1;
+    std::vector<const void*> entries;
+    std::vector<int> blockLengths;
+    std::vector<int> heat; // -1 once compiling at that pc has failed
+    std::vector<bool> leaders; // jump and CALL targets, the instructions after branches and after ones that are not compiled
+    std::map<int, std::vector<uint8_t*>> pendingLinks; // jumps waiting for a block to be compiled at pc
+};
+
+// Basic block compiler for x86-64. Blocks keep acc, fs, retReg and the budget
+// in host registers and are chained with direct jumps; anything that needs the
+// rest of the machine (interrupts, strings, variables, stack, division) ends
+// the block so the interpreter runs it.
+class Jit
+{
+    public:
+        bool Available();
+        void Prepare(JitImage &image, const std::vector<DecodedInstruction> &instructions);
+        const void *Compile(JitImage &image, const std::vector<DecodedInstruction> &instructions, int pc);
+        void Enter(JitFrame *frame, const void *block);
+
+    private:
+        bool initialised = false;
+        bool available = false;
+        int generation = 0;
+        uint8_t *buffer = nullptr;
+        size_t used = 0;
+        size_t blocksStart = 0;
+        uint8_t *epilogue = nullptr;
+        void (*trampoline)(JitFrame *frame, const void *block) = nullptr;
+
+        void Init();
+        bool Protect(int protection); // the whole buffer, PROT_* flags
+        const void *Emit(JitImage &image, const std::vector<DecodedInstruction> &instructions, int start);
+        void Flush();
+        void Reset(JitImage &image, const std::vector<DecodedInstruction> &instructions);
+};
+
+inline Jit jit;
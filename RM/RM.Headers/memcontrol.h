@@ -1,11 +1,16 @@
 #pragma once
 #include <array>
+#include <bitset>
 #include <map>
 #include <vector>
 #include "IOControl.h"
+#include "ReplacementPolicy.h"
 #include "SizeDefinitions.h"
 #include <limits>
+#include <memory>
 #include <string>
+#include <stdexcept>
+#include <unordered_map>
 
 //pages and frames are fixed size (4kb)
 
@@ -16,13 +21,50 @@ struct Page
     int timesAccessed;
     int frame; 
     int swapSector;
+    int version; // bumped whenever the page contents may change, never reset
+    bool copyOnWrite; // the frame is shared with other pages, a write gives this page a copy
+};
+
+// Raised when a translated address lands on a page that is out in swap
+class PageFault : public std::runtime_error
+{
+    public:
+        int page;
+        PageFault(int page) : std::runtime_error("Unhandled page fault"), page(page) {}
+};
+
+// Raised when no frame, swap sector or heap block is left for an allocation
+class OutOfMemory : public std::runtime_error
+{
+    public:
+        OutOfMemory(const char *what) : std::runtime_error(what) {}
+};
+
+// Virtual addresses of a segment, worked out from its pages instead of being
+// stored: the i-th address is word i % SEGMENT_PAGE_WORDS of page i / SEGMENT_PAGE_WORDS
+class AddressList
+{
+    public:
+        AddressList() = default;
+        AddressList(std::vector<int> pages);
+
+        int operator[](size_t i) const { return (pages[i / SEGMENT_PAGE_WORDS] << 12) + i % SEGMENT_PAGE_WORDS; }
+        size_t size() const { return pages.size() * SEGMENT_PAGE_WORDS; }
+        int back() const { return (*this)[size() - 1]; }
+        bool Contains(int address) const;
+
+        void Append(const AddressList &other);
+
+    private:
+        std::vector<int> pages;
+        std::bitset<PAGETABLE_SIZE> inList;
 };
 
 struct Memory
 {
     //memory protection is planned to be added at the OS level
     std::vector<int> usedPages;
-    std::vector<int> addresses;
+    AddressList addresses;
 };
 
 struct Segment
@@ -53,6 +95,8 @@ struct Program
     Segment codeSegment;
     Segment stackSegment;
     CpuSnapshot cpuSnapshot;
+    long long cycles = 0; // instructions executed while it was the active program
+    std::unordered_map<int, int> variables; // variable id -> offset of its slot from dataSegment.startPointer
 };
 
 struct Process
@@ -62,23 +106,49 @@ struct Process
     Program program;
     std::vector<std::string> args;
     int parent;
-    std::vector<Process> childProcesses;
+    int firstChild = -1; // children are linked through nextSibling, all ids index processList
+    int nextSibling = -1;
     int status; // 0 dead 1 alive 2 zombie
 };
 
+// A cached translation of one page, hits are added to the page's timesAccessed
+// when the entry is dropped instead of on every access
+struct TlbEntry
+{
+    int page = -1;
+    int frameStart;
+    int hits;
+};
+
 struct HeapBlockHandler
 {
-    Program owner;
+    int owner; // process id, -1 for the program started by the clock
     int size;
-    int start;
+    int start; // -1 once the entry was merged into a neighbour and is waiting for reuse
     bool free;
+    int capacity; // words the block spans, the string plus its terminator and slack
+    int prevFree; // free list links of its size class, indices into HeapBlockHandlers
+    int nextFree;
+};
+
+// Allocator state over HeapBlockHandlers, which tile the whole heap region.
+// Rebuilt from the blocks whenever they are cleared or restored
+struct HeapIndex
+{
+    std::vector<int> blockAt; // offset from HEAP_START of a block's first and last word -> its entry
+    std::array<int, HEAP_CLASSES> freeLists; // first free block of each size class, -1 when empty
+    unsigned int nonEmptyClasses = 0; // bit k set while freeLists[k] has a block
+    std::vector<int> unusedEntries; // merged away entries of HeapBlockHandlers
 };
 
 inline std::array<int, RAM_SIZE> RAM = {0};
 inline std::array<int, VRAM_SIZE> VRAM = {0};
 inline std::array<Page, PAGETABLE_SIZE> pageTable;
-inline std::array<int, FRAMETABLE_SIZE> frameTable;
+inline std::array<int, FRAMETABLE_SIZE> frameTable; // pages mapping each frame, more than one when shared
 inline std::vector<HeapBlockHandler> HeapBlockHandlers;
+inline unsigned int translationEpoch = 0; // moves whenever a page changes frame, software TLBs drop their entries then
+inline unsigned int pageStateEpoch = 0; // moves whenever a page is taken, freed, swapped or remapped, page pools are rebuilt when another Memcontrol moved it
+inline HeapIndex heapIndex;
 inline std::vector<Process> processList;
 
 class Memcontrol
@@ -87,45 +157,116 @@ class Memcontrol
         Memcontrol();
         int activeProcessId;
 
+        // Event counters, guest programs read them through int 37
+        long long pageFaults = 0;
+        long long pageHits = 0; // translations of pages in memory, together with pageFaults they rate the replacement policy
+        long long swapIns = 0;
+        long long swapOuts = 0;
+        long long heapBytesAllocated = 0;
+        long long prefetchedPages = 0; // swapped in ahead of a switch instead of on a fault
+
         Memory AllocateMemory(uint16_t size, std::vector<int> pagesToIgnore = {});
         void FreeMemory(Memory mem);
+        void FreeProgram(Program &program); // code, data and stack, the program is left without pages
 
         // Write and Read operations translate virtual address into physical
         void WriteRAM(int address, int value);
         uint16_t ReadRAM(int address);
 
+        // Block operations over virtual addresses, done a page run at a time
+        void CopyRAM(int dest, int src, int count); // overlapping ranges are copied like memmove
+        void FillRAM(int dest, int value, int count);
+        int CompareRAM(int first, int second, int count); // -1, 0 or 1 at the first word that differs
+
+        // Element-wise dest op= src, ranges should either be the same or not overlap
+        void AddRAM(int dest, int src, int count);
+        void MultiplyRAM(int dest, int src, int count);
+        int SumRAM(int address, int count);
+        int MinRAM(int address, int count); // INT_MAX for an empty range
+        int MaxRAM(int address, int count); // INT_MIN for an empty range
+
         // Segment control operations
         Segment InitSegment(int direction, int pageCount = 1);
         void WriteSegment(Segment segment, int address, int value);
         uint16_t ReadSegment(Segment segment, int address);
 
-        int GetVarAddrIfExists(Program program, int var); //returns an address for a new variable
-        int FindVarAddress(Program program, int var);
+        int GetVarAddrIfExists(const Program &program, int var); //returns -1 if var was not declared yet
+        int FindVarAddress(const Program &program, int var);
         int FindPtrAddress();
 
-        Program PrepareProgramMemory(Program program);
-        int ConvertToPhysAddress(int addr);
+        void SwapIn(int page, const std::vector<int> &pinned = {}); // pinned pages are not swapped out to make room
+        int ConvertToPhysAddress(int addr); // throws PageFault for a page in swap
+        void FlushTlb(); // also publishes the access counts the entries collected
+        void CountAccesses(int page, int count); // for accesses that did not go through ConvertToPhysAddress
+
+        // Working sets are the pages a process touched in its last time slice. The
+        // pages of the one that runs next are read from swap in the background
+        // while the current one runs, and go back into memory when it gets the cpu
+        void EndSlice(); // records the working set of activeProcessId
+        void Prefetch(int processId);
+        void CompletePrefetch(int processId); // pages read for any other process are dropped
+        void CancelPrefetch(); // waits for the reads and drops what they read
+        const std::vector<int> &WorkingSet(int processId) { return workingSets[processId]; }
+
+        void SetReplacementPolicy(ReplacementKind kind);
+        const char *ReplacementPolicyName() const { return replacement.Name(); }
         
         int MoveToSwap(int pageNumber); 
+        Memory ShareMemory(Memory memory); // maps new pages copy-on-write onto the same frames, empty if that is not possible
 
-        HeapBlockHandler HeapAlloc(Program owner, int size);
-        void HeapFree(HeapBlockHandler *handler);
+        HeapBlockHandler HeapAlloc(int owner, int size, int slack = 0); // slack words are reserved after the string for HeapAppend
+        void HeapFree(int start); // anything that is not the start of a used block is ignored
+        void HeapFreeOwnedBy(int owner); // every block the process allocated, once it is gone
+        HeapBlockHandler FindHeapBlock(int start); // size is -1 if no used block starts there
+        void RebuildHeapIndex();
         void StoreStringInHeap(HeapBlockHandler handler, std::string str);
         std::string ReadStringFromHeap(HeapBlockHandler handler);
+        bool HeapAppend(int start, const std::string &str); // false if the block has no room left for str
 
-        int ForkProcess(std::vector<std::string> args, Program program); //returns new process id
-        void StopCurrentProcess(); // stops current process and sets it's parent process as active
+        int ForkProcess(std::vector<std::string> args, Program program, bool shareCode = false); //returns new process id, -1 if the code can't be shared
+        void StopCurrentProcess(); // marks the current process dead, the scheduler picks what runs next
         std::string getProcessInfoString(int index);
 
     private:
-        std::vector<int> freeFramePool;
-        std::vector<int> freeSectorPool;
+        // One bit per page, kept in step with the page table so a free page is
+        // found with a find-first-set over the words instead of a scan
+        std::vector<uint64_t> freeFramePool; // unused pages holding a frame
+        std::vector<uint64_t> freeSectorPool; // unused pages in memory holding a swap sector
+        unsigned int poolEpoch = 0;
+        ReplacementPolicy replacement; // rebuilt from the page table along with the pools
+
+        std::bitset<PAGETABLE_SIZE> sliceTouched;
+        std::map<int, std::vector<int>> workingSets; // process id -> pages, -1 for the program started by the clock
+        std::vector<std::pair<int, int>> prefetching; // page -> the sector being read for it
+        int prefetchProcess = -1;
 
         IOControl iocontroller = IOControl();
 
+        std::array<TlbEntry, TLB_SIZE> tlb;
+        unsigned int tlbEpoch = 0;
+
+        int TranslateMiss(int pageNumber, int offset);
+
+        void SyncPagePools();
+        void PageStateChanged(int page);
+        int FirstInPool(const std::vector<uint64_t> &pool, int skip = -1); // -1 if the pool is empty
+
         void ClearPageBeforeUse(int page);
+        void BreakSharing(int page);
+        int TakeFreeFrame(const std::vector<int> &pinned);
+        void DetachSharedPage(int page);
+        void PrepareBlock(int address, int count, bool write);
+        void TranslateBlock(int address, int count);
+        int *BlockRun(int address, bool write);
+        void CombineRAM(int dest, int src, int count, void (*kernel)(int*, const int*, int));
+        int ReduceRAM(int address, int count, int initial, int (*kernel)(const int*, int, int));
 
         std::array<int, PAGE_SIZE> GetFromSwap(int pageNumber);
-        int FindLeastAccessedPage(std::vector<int> collectedPages = {});
-        std::vector<int> GetAddressList(std::vector<int> pages);
+        int FindVictimPage(const std::vector<int> &collectedPages = {});
+
+        int NewHeapEntry(int start, int capacity);
+        void TagHeapBlock(int entry);
+        int HeapEntryAt(int start); // -1 if no used block starts there
+        void PushFreeBlock(int entry);
+        void UnlinkFreeBlock(int entry);
 };
\ No newline at end of file
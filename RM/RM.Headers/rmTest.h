@@ -25,4 +25,32 @@ class RmTest
         bool ExecuteProgramTest_WhenMemoryOnSwap_RetrievesMemoryFromSwap();
         bool ExecuteProgramTest_MemoryIsFreed_PagesCanBeAccessed();
         bool ExecuteProgramTest_SeveralProgramsExecuted_ExecuteSuccesfully();
+        bool ExecuteProgramTest_WhenCodeRewrittenAfterLoad_ExecutesNewCode();
+        bool ExecuteProgramTest_SwitchAndThreadedEngines_ProduceSameState();
+        bool RunTest_GivenSmallQuanta_ProducesSameStateAsSingleRun();
+        bool ExecuteProgramTest_JitEngine_ProducesSameStateAsSwitch();
+        bool ExecuteProgramTest_FusedCompareAndBranch_ProducesSameStateAsSwitch();
+        bool SchedulerTest_GivenReadyProcesses_RunsThemRoundRobin();
+        bool SchedulerTest_WhenChildExits_WakesWaitingParent();
+        bool ForkProcessTest_WhenParentStops_ChildrenBecomeZombies();
+        bool InterruptTest_ReadCounters_ReportsRetiredInstructions();
+        bool SnapshotTest_GivenSavedMachine_RestoredMachineRunsTheSame();
+        bool ForkProcessTest_SharedCode_IsCopiedOnWrite();
+        bool FindProgramCodeTest_WhenDriveChanges_ImageCacheIsDropped();
+        bool ExecuteProgramTest_GivenManyVariables_EachKeepsItsValue();
+        bool HeapTest_FreedBlocks_AreReusedAndCoalesced();
+        bool HeapTest_FindHeapBlock_ReturnsBlockStartingThere();
+        bool ExecuteProgramTest_RepeatedStrcat_GrowsStringInPlace();
+        bool ExecuteProgramTest_BlockMemoryInstructions_CrossPageBoundaries();
+        bool ExecuteProgramTest_VectorInstructions_CrossPageBoundaries();
+        bool TranslationTest_CachedTranslation_IsDroppedWhenPageIsSwapped();
+        bool AllocationTest_FreedPages_AreReusedAcrossControllers();
+        bool ReplacementTest_FrequentlyUsedPage_StaysInMemory();
+        bool ExecuteProgramTest_PagesInSwap_AreBroughtInWhenTouched();
+        bool PrefetchTest_WorkingSetPages_AreSwappedInAhead();
+        bool ExecuteProgramTest_FaultInFusedRun_RetiresOnlyCompletedInstructions();
+        bool ForkProcessTest_WhenProcessStops_ItsPagesAreFreed();
+        bool ForkProcessTest_WhenHeapRunsOut_ProcessIsKilled();
+        bool ForkProcessTest_WhenLaunchedTwice_CodeIsShared();
+        bool FlagsTest_LazyFlags_MatchEagerFlags();
 };
\ No newline at end of file
@@ -1,6 +1,33 @@
 #include "rmTest.h"
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <functional>
+
+// Loads source on a fresh cpu with engine and runs it for runs slices of budget instructions,
+// afterRun is called after every slice. Returns what the engine comparisons look at: retired
+// instructions, the registers and the first words of the data segment
+template<typename Source>
+static std::vector<long long> RunOnEngine(const Source &source, ExecutionEngine engine, int budget, int runs = 1,
+    std::function<void(Cpu &cpu, Program &program, int run)> afterRun = nullptr)
+{
+    Cpu cpu = Cpu();
+    cpu.engine = engine;
+    Program program = cpu.LoadProgram(source);
+    for(int run = 0; run < runs && (program.cpuSnapshot.fs & ef) == 0; run++)
+    {
+        program = cpu.ExecuteProgram(program, budget);
+        if(afterRun)
+            afterRun(cpu, program, run);
+    }
+
+    CpuSnapshot snap = program.cpuSnapshot;
+    std::vector<long long> state = {cpu.instructionsRetired, snap.pc, snap.addr, snap.acc, snap.ir, snap.sp,
+        snap.fs, snap.xReg, snap.cReg, snap.retReg};
+    for(int i = 0; i < 4 && i < (int)program.dataSegment.memory.addresses.size(); i++)
+        state.push_back(RAM[program.dataSegment.memory.addresses[i]]);
+    return state;
+}
 
 // Set up Test Environment
 RmTest::RmTest()
@@ -112,6 +139,286 @@ void RmTest::RunAllTests()
         std::cout << "FAILED" << std::endl;
     }
 
+    std::cout << "ExecuteProgramTest_WhenCodeRewrittenAfterLoad_ExecutesNewCode...";
+    if(ExecuteProgramTest_WhenCodeRewrittenAfterLoad_ExecutesNewCode())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_SwitchAndThreadedEngines_ProduceSameState...";
+    if(ExecuteProgramTest_SwitchAndThreadedEngines_ProduceSameState())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "RunTest_GivenSmallQuanta_ProducesSameStateAsSingleRun...";
+    if(RunTest_GivenSmallQuanta_ProducesSameStateAsSingleRun())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_JitEngine_ProducesSameStateAsSwitch...";
+    if(ExecuteProgramTest_JitEngine_ProducesSameStateAsSwitch())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_FusedCompareAndBranch_ProducesSameStateAsSwitch...";
+    if(ExecuteProgramTest_FusedCompareAndBranch_ProducesSameStateAsSwitch())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "SchedulerTest_GivenReadyProcesses_RunsThemRoundRobin...";
+    if(SchedulerTest_GivenReadyProcesses_RunsThemRoundRobin())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "SchedulerTest_WhenChildExits_WakesWaitingParent...";
+    if(SchedulerTest_WhenChildExits_WakesWaitingParent())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ForkProcessTest_WhenParentStops_ChildrenBecomeZombies...";
+    if(ForkProcessTest_WhenParentStops_ChildrenBecomeZombies())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "InterruptTest_ReadCounters_ReportsRetiredInstructions...";
+    if(InterruptTest_ReadCounters_ReportsRetiredInstructions())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "SnapshotTest_GivenSavedMachine_RestoredMachineRunsTheSame...";
+    if(SnapshotTest_GivenSavedMachine_RestoredMachineRunsTheSame())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ForkProcessTest_SharedCode_IsCopiedOnWrite...";
+    if(ForkProcessTest_SharedCode_IsCopiedOnWrite())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "FindProgramCodeTest_WhenDriveChanges_ImageCacheIsDropped...";
+    if(FindProgramCodeTest_WhenDriveChanges_ImageCacheIsDropped())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_GivenManyVariables_EachKeepsItsValue...";
+    if(ExecuteProgramTest_GivenManyVariables_EachKeepsItsValue())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "HeapTest_FreedBlocks_AreReusedAndCoalesced...";
+    if(HeapTest_FreedBlocks_AreReusedAndCoalesced())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "HeapTest_FindHeapBlock_ReturnsBlockStartingThere...";
+    if(HeapTest_FindHeapBlock_ReturnsBlockStartingThere())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_RepeatedStrcat_GrowsStringInPlace...";
+    if(ExecuteProgramTest_RepeatedStrcat_GrowsStringInPlace())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_BlockMemoryInstructions_CrossPageBoundaries...";
+    if(ExecuteProgramTest_BlockMemoryInstructions_CrossPageBoundaries())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_VectorInstructions_CrossPageBoundaries...";
+    if(ExecuteProgramTest_VectorInstructions_CrossPageBoundaries())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "TranslationTest_CachedTranslation_IsDroppedWhenPageIsSwapped...";
+    if(TranslationTest_CachedTranslation_IsDroppedWhenPageIsSwapped())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "AllocationTest_FreedPages_AreReusedAcrossControllers...";
+    if(AllocationTest_FreedPages_AreReusedAcrossControllers())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ReplacementTest_FrequentlyUsedPage_StaysInMemory...";
+    if(ReplacementTest_FrequentlyUsedPage_StaysInMemory())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_PagesInSwap_AreBroughtInWhenTouched...";
+    if(ExecuteProgramTest_PagesInSwap_AreBroughtInWhenTouched())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "PrefetchTest_WorkingSetPages_AreSwappedInAhead...";
+    if(PrefetchTest_WorkingSetPages_AreSwappedInAhead())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ExecuteProgramTest_FaultInFusedRun_RetiresOnlyCompletedInstructions...";
+    if(ExecuteProgramTest_FaultInFusedRun_RetiresOnlyCompletedInstructions())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ForkProcessTest_WhenProcessStops_ItsPagesAreFreed...";
+    if(ForkProcessTest_WhenProcessStops_ItsPagesAreFreed())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ForkProcessTest_WhenHeapRunsOut_ProcessIsKilled...";
+    if(ForkProcessTest_WhenHeapRunsOut_ProcessIsKilled())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "ForkProcessTest_WhenLaunchedTwice_CodeIsShared...";
+    if(ForkProcessTest_WhenLaunchedTwice_CodeIsShared())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
+    std::cout << "FlagsTest_LazyFlags_MatchEagerFlags...";
+    if(FlagsTest_LazyFlags_MatchEagerFlags())
+    {
+        std::cout << "PASSED" << std::endl;
+    }
+    else 
+    {
+        std::cout << "FAILED" << std::endl;
+    }
+
     std::cout << "LoadProgramTest_GivenSeveralPrograms_LoadedSuccesfully...";
     if(LoadProgramTest_GivenSeveralPrograms_LoadedSuccesfully())
     {
@@ -247,9 +554,10 @@ bool RmTest::ExecuteProgramTest_WhenMemoryOnSwap_RetrievesMemoryFromSwap()
 
     cpu.ExecuteProgram(programToBeExecuted);
 
+    // the data page comes back in a different frame, so it is read through the page table
     for(int i = 0; i < expectedDataSegm.size(); i++)
     {
-        if(RAM[programToBeExecuted.dataSegment.memory.addresses[i]] != expectedDataSegm[i])
+        if(cpu.memcontroller.ReadRAM(programToBeExecuted.dataSegment.memory.addresses[i]) != expectedDataSegm[i])
             return false;
     }
 
@@ -343,6 +651,789 @@ bool RmTest::ExecuteProgramTest_SeveralProgramsExecuted_ExecuteSuccesfully()
     return true;
 }
 
+bool RmTest::ExecuteProgramTest_WhenCodeRewrittenAfterLoad_ExecutesNewCode()
+{
+    Cpu cpu = Cpu();
+    Program program = cpu.LoadProgram("small.txt");
+    std::vector<int> expectedDataSegm = {97, 20, 98, 100, 99, 120};
+
+    // loadi 10 -> loadi 20, the decoded code has to be dropped
+    cpu.memcontroller.WriteSegment(program.codeSegment, program.codeSegment.memory.addresses[3], 20);
+    cpu.ExecuteProgram(program);
+
+    for(int i = 0; i < expectedDataSegm.size(); i++)
+    {
+        int x = RAM[program.dataSegment.memory.addresses[i]];
+        if(x != expectedDataSegm[i])
+            return false;
+    }
+
+    return true;
+}
+
+bool RmTest::ExecuteProgramTest_SwitchAndThreadedEngines_ProduceSameState()
+{
+    std::string program = "big.txt";
+    return RunOnEngine(program, ENGINE_SWITCH, 10000) == RunOnEngine(program, ENGINE_THREADED, 10000);
+}
+
+bool RmTest::RunTest_GivenSmallQuanta_ProducesSameStateAsSingleRun()
+{
+    std::vector<int> results[2];
+
+    for(int r = 0; r < 2; r++)
+    {
+        Cpu cpu = Cpu();
+        Program program = cpu.LoadProgram("big.txt");
+        if(r == 0)
+        {
+            program = cpu.ExecuteProgram(program, 10000);
+        }
+        else
+        {
+            cpu.EnterProgram(program);
+            int total = 0;
+            while(total < 10000)
+            {
+                int executed = 0;
+                CpuEvent event = cpu.Run(std::min(7, 10000 - total), &executed);
+                total += executed;
+                if(event == EVENT_HALT)
+                    break;
+                if(event != EVENT_BUDGET && event != EVENT_STOP)
+                    return false;
+            }
+            program = cpu.activeProgram;
+            program.cpuSnapshot = cpu.SaveToSnapshot();
+        }
+
+        CpuSnapshot snap = program.cpuSnapshot;
+        results[r] = {snap.pc, snap.acc, snap.sp, snap.fs, snap.xReg, snap.cReg};
+        for(int i = 0; i < 4; i++)
+        {
+            results[r].push_back(RAM[program.dataSegment.memory.addresses[i]]);
+        }
+    }
+
+    return results[0] == results[1];
+}
+
+bool RmTest::ExecuteProgramTest_JitEngine_ProducesSameStateAsSwitch()
+{
+    // a hot loop that ends up in compiled blocks, stopped at budgets that split blocks
+    std::vector<int> code = {LOADI, 0, INC, ADDA, 5, CMPI, 3, INC, JMP, 2};
+    int budgets[] = {7, 1000, 12345};
+
+    for(int budget : budgets)
+    {
+        // the loop has to have run as compiled code, not only in the interpreter
+        bool compiled = false;
+        auto findCompiled = [&compiled](Cpu &cpu, Program &program, int run)
+        {
+            for(auto &entry : cpu.decodedPrograms)
+            {
+                if(entry.second.jitImage == nullptr)
+                    continue;
+                for(const void *block : entry.second.jitImage->entries)
+                    compiled = compiled || block != nullptr;
+            }
+        };
+
+        if(RunOnEngine(code, ENGINE_SWITCH, budget, 3) != RunOnEngine(code, ENGINE_JIT, budget, 3, findCompiled))
+            return false;
+        if(jit.Available() && budget > 7 && !compiled)
+            return false;
+    }
+
+    return true;
+}
+
+bool RmTest::ExecuteProgramTest_FusedCompareAndBranch_ProducesSameStateAsSwitch()
+{
+    // loadi / cmpr / jnz and loadi / cmpr / jz runs, budgets also end in the middle of them
+    std::vector<int> code = {LOADI, 1, STORER, 'c', LOADI, 2, CMPR, 'c', JNZ, 15, INC, STORER, 'x',
+        JMP, 4, LOADI, 1, CMPR, 'x', JZ, 4, JMP, 0};
+    int budgets[] = {5, 17, 1000};
+
+    for(int budget : budgets)
+    {
+        if(RunOnEngine(code, ENGINE_SWITCH, budget, 3) != RunOnEngine(code, ENGINE_THREADED, budget, 3))
+            return false;
+    }
+
+    return true;
+}
+
+bool RmTest::SchedulerTest_GivenReadyProcesses_RunsThemRoundRobin()
+{
+    Scheduler scheduler = Scheduler();
+    scheduler.Add(-1);
+    scheduler.Add(0);
+    scheduler.Add(1);
+
+    // a preempted process goes to the back of the queue
+    std::vector<int> order;
+    for(int i = 0; i < 6; i++)
+    {
+        int next = scheduler.Next();
+        order.push_back(next);
+        scheduler.Add(next);
+    }
+
+    return order == std::vector<int>({-1, 0, 1, -1, 0, 1});
+}
+
+bool RmTest::SchedulerTest_WhenChildExits_WakesWaitingParent()
+{
+    Scheduler scheduler = Scheduler();
+    scheduler.Add(1);
+    scheduler.Wait(0, 1);
+
+    if(scheduler.Next() != 1 || scheduler.HasReady())
+        return false;
+
+    scheduler.Exited(1);
+    if(scheduler.Next() != 0)
+        return false;
+
+    return scheduler.Next() == NO_PROCESS;
+}
+
+bool RmTest::ForkProcessTest_WhenParentStops_ChildrenBecomeZombies()
+{
+    Cpu cpu = Cpu();
+    Program program = cpu.LoadProgram("small.txt");
+    processList.clear();
+
+    int parent = cpu.memcontroller.ForkProcess({"parent"}, program);
+    cpu.memcontroller.activeProcessId = parent;
+    int first = cpu.memcontroller.ForkProcess({"first"}, program);
+    int second = cpu.memcontroller.ForkProcess({"second"}, program);
+
+    // addresses of a copy follow from the same pages
+    if(processList[first].program.codeSegment.memory.addresses[100] != program.codeSegment.memory.addresses[100])
+        return false;
+
+    cpu.memcontroller.StopCurrentProcess();
+    bool result = processList[parent].status == 0 && processList[first].status == 2 &&
+        processList[second].status == 2 && processList[first].parent == parent;
+    processList.clear();
+    return result;
+}
+
+bool RmTest::InterruptTest_ReadCounters_ReportsRetiredInstructions()
+{
+    // the int 37 reading a counter is counted as well
+    std::vector<int> code = {INC, INC, INC, LOADI, COUNTER_INSTRUCTIONS, INT, 37, STORER, 'x',
+        LOADI, COUNTER_PROCESS_CYCLES, INT, 37, STORER, 'c', LOADI, 99, INT, 37, STOP};
+    ExecutionEngine engines[] = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT};
+
+    for(ExecutionEngine engine : engines)
+    {
+        Cpu cpu = Cpu();
+        cpu.engine = engine;
+        Program program = cpu.LoadProgram(code);
+        program = cpu.ExecuteProgram(program);
+
+        CpuSnapshot snap = program.cpuSnapshot;
+        if(snap.xReg != 5 || snap.cReg != 8 || snap.acc != -1 || program.cycles != 12)
+            return false;
+    }
+
+    return true;
+}
+
+bool RmTest::SnapshotTest_GivenSavedMachine_RestoredMachineRunsTheSame()
+{
+    std::vector<int> results[2];
+    std::array<int, PAGE_SIZE> swapped[2];
+
+    Cpu cpu = Cpu();
+    Program other = cpu.LoadProgram("small.txt");
+    int swappedPage = other.codeSegment.memory.usedPages[0];
+    cpu.memcontroller.MoveToSwap(swappedPage);
+    cpu.EnterProgram(cpu.LoadProgram("big.txt"));
+    cpu.Run(1000);
+    cpu.SaveMachine("test.snap");
+
+    for(int r = 0; r < 2; r++)
+    {
+        if(r == 1)
+        {
+            RAM.fill(0);
+            cpu = Cpu();
+            if(!cpu.RestoreMachine("test.snap"))
+                return false;
+        }
+
+        swapped[r] = cpu.iocontroller.PeekSwapData(pageTable[swappedPage].swapSector);
+        cpu.Run(5000);
+        CpuSnapshot snap = cpu.SaveToSnapshot();
+        results[r] = {snap.pc, snap.acc, snap.sp, snap.fs, snap.xReg, snap.cReg, pageTable[swappedPage].onDisk};
+        for(int i = 0; i < 4; i++)
+        {
+            results[r].push_back(RAM[cpu.activeProgram.dataSegment.memory.addresses[i]]);
+        }
+    }
+
+    remove("test.snap");
+    return results[0] == results[1] && swapped[0] == swapped[1] && swapped[1][0] == VAR;
+}
+
+bool RmTest::ForkProcessTest_SharedCode_IsCopiedOnWrite()
+{
+    Cpu cpu = Cpu();
+    Program program = cpu.LoadProgram("small.txt");
+    processList.clear();
+
+    int child = cpu.memcontroller.ForkProcess({"small"}, program, true);
+    if(child == -1)
+        return false;
+    Program forked = processList[child].program;
+    processList.clear();
+
+    int parentPage = program.codeSegment.memory.usedPages[0];
+    int childPage = forked.codeSegment.memory.usedPages[0];
+    if(parentPage == childPage || pageTable[parentPage].frame != pageTable[childPage].frame)
+        return false;
+    if(RAM[cpu.memcontroller.ConvertToPhysAddress(forked.codeSegment.memory.addresses[0])] != VAR)
+        return false;
+
+    // the write goes to a copy, the parent still sees its own code
+    cpu.memcontroller.WriteSegment(forked.codeSegment, forked.codeSegment.memory.addresses[0], STOP);
+    if(pageTable[parentPage].frame == pageTable[childPage].frame)
+        return false;
+    if(pageTable[parentPage].copyOnWrite || pageTable[childPage].copyOnWrite)
+        return false;
+
+    return RAM[cpu.memcontroller.ConvertToPhysAddress(program.codeSegment.memory.addresses[0])] == VAR &&
+        RAM[cpu.memcontroller.ConvertToPhysAddress(forked.codeSegment.memory.addresses[0])] == STOP &&
+        RAM[cpu.memcontroller.ConvertToPhysAddress(forked.codeSegment.memory.addresses[2])] == LOADI;
+}
+
+bool RmTest::FindProgramCodeTest_WhenDriveChanges_ImageCacheIsDropped()
+{
+    IOControl io = IOControl();
+    io.modifyDriveData({1453, 1, 'p', 3, LOADI, 5, STOP, -2});
+    if(io.FindProgramCode("p", 1453) != std::vector<int>({LOADI, 5, STOP}))
+        return false;
+
+    // found again without reading the drive
+    remove(DRIVE);
+    if(io.FindProgramCode("p", 1453) != std::vector<int>({LOADI, 5, STOP}))
+        return false;
+
+    // launched copies of the old code are not shared any more either
+    long long generation = driveGeneration;
+    io.modifyDriveData({1453, 1, 'p', 2, INC, STOP, -2});
+    bool result = io.FindProgramCode("p", 1453) == std::vector<int>({INC, STOP}) && driveGeneration == generation + 1;
+    remove(DRIVE);
+    programImages.clear();
+    return result;
+}
+
+bool RmTest::ExecuteProgramTest_GivenManyVariables_EachKeepsItsValue()
+{
+    // every variable is declared twice, the second VAR must not give it a new slot
+    std::vector<int> code;
+    for(int id = 1; id <= 300; id++)
+    {
+        code.insert(code.end(), {VAR, id, LOADI, id * 3, STOREV, id, VAR, id});
+    }
+    code.insert(code.end(), {LOADV, 7, STOP});
+
+    Cpu cpu = Cpu();
+    Program program = cpu.LoadProgram(code);
+    program = cpu.ExecuteProgram(program, 100000);
+
+    if(program.cpuSnapshot.acc != 21 || program.variables.size() != 300)
+        return false;
+    if(program.dataSegment.writePointer != program.dataSegment.startPointer + 600)
+        return false;
+
+    for(int id = 1; id <= 300; id++)
+    {
+        int addr = cpu.memcontroller.FindVarAddress(program, id);
+        if(RAM[addr] != id || RAM[addr+1] != id * 3)
+            return false;
+    }
+    return true;
+}
+
+bool RmTest::HeapTest_FreedBlocks_AreReusedAndCoalesced()
+{
+    HeapBlockHandlers.clear();
+    Memcontrol memcontroller = Memcontrol();
+
+    HeapBlockHandler a = memcontroller.HeapAlloc(1, 10);
+    HeapBlockHandler b = memcontroller.HeapAlloc(1, 10);
+    HeapBlockHandler c = memcontroller.HeapAlloc(1, 10);
+    if(a.start != HEAP_START || b.start < a.start + 12 || c.start < b.start + 12)
+        return false;
+
+    // a freed block is handed out again to a request of the same size
+    memcontroller.HeapFree(b.start);
+    if(memcontroller.HeapAlloc(2, 10).start != b.start)
+        return false;
+
+    // neighbours freed on both sides merge into one block big enough for all three
+    memcontroller.HeapFree(a.start);
+    memcontroller.HeapFree(c.start);
+    memcontroller.HeapFree(b.start);
+    memcontroller.HeapFree(b.start);
+    HeapBlockHandler merged = memcontroller.HeapAlloc(3, 34);
+    if(merged.start != HEAP_START)
+        return false;
+
+    memcontroller.StoreStringInHeap(merged, std::string(34, 'x'));
+    std::string str = memcontroller.ReadStringFromHeap(merged);
+    HeapBlockHandlers.clear();
+    return str == std::string(34, 'x') + '\0';
+}
+
+bool RmTest::HeapTest_FindHeapBlock_ReturnsBlockStartingThere()
+{
+    HeapBlockHandlers.clear();
+    Memcontrol memcontroller = Memcontrol();
+
+    std::vector<HeapBlockHandler> blocks;
+    for(int i = 0; i < 1000; i++)
+    {
+        blocks.push_back(memcontroller.HeapAlloc(i, i % 20 + 1));
+    }
+    memcontroller.HeapFree(blocks[500].start);
+
+    for(int i = 0; i < 1000; i++)
+    {
+        HeapBlockHandler found = memcontroller.FindHeapBlock(blocks[i].start);
+        if(i == 500 && found.size != -1)
+            return false;
+        if(i != 500 && (found.owner != i || found.size != i % 20 + 1))
+            return false;
+    }
+
+    // addresses inside a block or outside the heap are not block starts
+    bool missing = memcontroller.FindHeapBlock(blocks[10].start + 1).size == -1 &&
+        memcontroller.FindHeapBlock(0).size == -1;
+    HeapBlockHandlers.clear();
+    return missing;
+}
+
+bool RmTest::ExecuteProgramTest_RepeatedStrcat_GrowsStringInPlace()
+{
+    std::vector<int> code = {STR, 'a', 0, STORER, 'x', STRCAT, 'b', 0, STORER, 'x'};
+    for(char c = 'c'; c <= 'z'; c++)
+    {
+        code.insert(code.end(), {STRCAT, c, 0, STORER, 'x'});
+    }
+    code.push_back(STOP);
+
+    Cpu cpu = Cpu();
+    Program program = cpu.LoadProgram(code);
+    program = cpu.ExecuteProgram(program, 1000);
+
+    // a moved string keeps as much slack as it is long, the appends after that are written in place
+    HeapBlockHandler handle = cpu.memcontroller.FindHeapBlock(program.cpuSnapshot.xReg);
+    if(handle.size != 27 || handle.capacity < 29)
+        return false;
+    return cpu.memcontroller.ReadStringFromHeap(handle) == std::string("abcdefghijklmnopqrstuvwxyz") + '\0';
+}
+
+bool RmTest::ExecuteProgramTest_BlockMemoryInstructions_CrossPageBoundaries()
+{
+    Cpu cpu = Cpu();
+    Memory memory = cpu.memcontroller.AllocateMemory(4 * PAGE_SIZE);
+    std::vector<int> pages = memory.usedPages;
+    for(int i = 1; i < pages.size(); i++)
+    {
+        if(pages[i] != pages[0] + i)
+            return false;
+    }
+
+    // both ranges run over the end of a page into the next one
+    int src = pages[0] * PAGE_SIZE + PAGE_SIZE - 100;
+    int dest = pages[2] * PAGE_SIZE + PAGE_SIZE - 50;
+    for(int i = 0; i < 300; i++)
+    {
+        cpu.memcontroller.WriteRAM(src + i, i + 1);
+    }
+
+    std::vector<int> code = {LOADI, dest, STORER, 'x', LOADI, src, STORER, 'c', LOADI, 300, MEMCPY, MEMCMP, STOP};
+    Program program = cpu.LoadProgram(code);
+    program = cpu.ExecuteProgram(program, 100);
+    if(program.cpuSnapshot.acc != 0)
+        return false;
+    for(int i = 0; i < 300; i++)
+    {
+        if(cpu.memcontroller.ReadRAM(dest + i) != i + 1)
+            return false;
+    }
+
+    cpu.memcontroller.FillRAM(dest + 40, 0, 20);
+    if(cpu.memcontroller.ReadRAM(dest + 59) != 0 || cpu.memcontroller.CompareRAM(dest, src, 300) != -1)
+        return false;
+
+    // overlapping copies behave like memmove
+    cpu.memcontroller.CopyRAM(src + 1, src, 299);
+    bool moved = cpu.memcontroller.ReadRAM(src + 1) == 1 && cpu.memcontroller.ReadRAM(src + 299) == 299;
+    cpu.memcontroller.FreeMemory(memory);
+    return moved;
+}
+
+bool RmTest::ExecuteProgramTest_VectorInstructions_CrossPageBoundaries()
+{
+    Cpu cpu = Cpu();
+    Memory memory = cpu.memcontroller.AllocateMemory(4 * PAGE_SIZE);
+    std::vector<int> pages = memory.usedPages;
+    for(int i = 1; i < pages.size(); i++)
+    {
+        if(pages[i] != pages[0] + i)
+            return false;
+    }
+
+    // both ranges run over the end of a page into the next one, and are not a multiple of the lane count
+    int a = pages[0] * PAGE_SIZE + PAGE_SIZE - 101;
+    int b = pages[2] * PAGE_SIZE + PAGE_SIZE - 50;
+    for(int i = 0; i < 301; i++)
+    {
+        cpu.memcontroller.WriteRAM(a + i, i + 1);
+        cpu.memcontroller.WriteRAM(b + i, 2);
+    }
+
+    std::vector<int> code = {LOADI, a, STORER, 'x', LOADI, b, STORER, 'c', LOADI, 301, VADD, VMUL, VSUM, STOP};
+    Program program = cpu.LoadProgram(code);
+    program = cpu.ExecuteProgram(program, 100);
+
+    // every word went from i+1 to 2*(i+3)
+    int expected = 0;
+    for(int i = 0; i < 301; i++)
+    {
+        if(cpu.memcontroller.ReadRAM(a + i) != 2 * (i + 3))
+            return false;
+        expected += 2 * (i + 3);
+    }
+    if(program.cpuSnapshot.acc != expected)
+        return false;
+
+    cpu.memcontroller.WriteRAM(a + 150, -7);
+    bool reduced = cpu.memcontroller.MinRAM(a, 301) == -7 && cpu.memcontroller.MaxRAM(a, 301) == 2 * 303 &&
+        cpu.memcontroller.MaxRAM(a, 0) == std::numeric_limits<int>::min();
+    cpu.memcontroller.FreeMemory(memory);
+    return reduced;
+}
+
+bool RmTest::TranslationTest_CachedTranslation_IsDroppedWhenPageIsSwapped()
+{
+    Memcontrol memcontroller = Memcontrol();
+    Memory memory = memcontroller.AllocateMemory(PAGE_SIZE);
+    int page = memory.usedPages[0];
+    int address = (page << 12) + 10;
+
+    int first = memcontroller.ConvertToPhysAddress(address);
+    int accessed = pageTable[page].timesAccessed;
+    for(int i = 0; i < 100; i++)
+    {
+        if(memcontroller.ConvertToPhysAddress(address + i) != first + i)
+            return false;
+    }
+
+    // hits are kept in the TLB until it is flushed
+    if(pageTable[page].timesAccessed != accessed)
+        return false;
+    memcontroller.FlushTlb();
+    if(pageTable[page].timesAccessed < accessed + 100)
+        return false;
+
+    // a cached translation must not outlive the page going to swap
+    memcontroller.ConvertToPhysAddress(address);
+    if(memcontroller.MoveToSwap(page) == -1)
+        return false;
+    try
+    {
+        memcontroller.ConvertToPhysAddress(address);
+    }
+    catch(PageFault *fault)
+    {
+        delete fault;
+        return true;
+    }
+    return false;
+}
+
+bool RmTest::AllocationTest_FreedPages_AreReusedAcrossControllers()
+{
+    Memcontrol first = Memcontrol();
+    Memcontrol second = Memcontrol();
+    Memory memory = first.AllocateMemory(PAGE_SIZE * 3);
+    Memory freed = {{memory.usedPages[1]}, AddressList({memory.usedPages[1]})};
+    first.FreeMemory(freed);
+
+    // the lowest free page is handed out again, even by another Memcontrol
+    Memory reused = second.AllocateMemory(PAGE_SIZE);
+    if(reused.usedPages[0] != memory.usedPages[1])
+        return false;
+
+    // and the first one must not hand it out twice
+    Memory next = first.AllocateMemory(PAGE_SIZE);
+    if(next.usedPages[0] == reused.usedPages[0] || pageTable[next.usedPages[0]].frame == -1)
+        return false;
+
+    // once the frames run out pages are taken from swap instead
+    Memory swapped;
+    for(int i = 0; i <= FRAMETABLE_SIZE && first.swapOuts == 0; i++)
+        swapped = first.AllocateMemory(PAGE_SIZE, memory.usedPages);
+    if(first.swapOuts != 1)
+        return false;
+    if(pageTable[swapped.usedPages[0]].frame == -1 || pageTable[swapped.usedPages[0]].onDisk)
+        return false;
+    for(int page : memory.usedPages)
+    {
+        if(page != memory.usedPages[1] && pageTable[page].onDisk)
+            return false;
+    }
+    return true;
+}
+
+bool RmTest::ReplacementTest_FrequentlyUsedPage_StaysInMemory()
+{
+    for(ReplacementKind kind : {REPLACE_CLOCK, REPLACE_LRU2, REPLACE_ARC})
+    {
+        Memcontrol memcontroller = Memcontrol();
+        memcontroller.SetReplacementPolicy(kind);
+        std::vector<int> pages;
+        for(int i = 0; i < FRAMETABLE_SIZE; i++)
+            pages.push_back(memcontroller.AllocateMemory(PAGE_SIZE).usedPages[0]);
+
+        // the first eviction sweeps the CLOCK hand past the bits set by the allocations
+        memcontroller.AllocateMemory(PAGE_SIZE);
+
+        // referenced twice, so it counts as frequently used by every policy
+        int hot = pages.back();
+        for(int i = 0; i < REPLACEMENT_K; i++)
+        {
+            memcontroller.ConvertToPhysAddress(hot << 12);
+            memcontroller.FlushTlb();
+        }
+
+        long long swapOuts = memcontroller.swapOuts;
+        Memory extra = memcontroller.AllocateMemory(PAGE_SIZE * 4);
+        if(memcontroller.swapOuts != swapOuts + 4 || pageTable[hot].onDisk)
+            return false;
+        for(int page : extra.usedPages)
+        {
+            if(pageTable[page].onDisk || pageTable[page].frame == -1)
+                return false;
+        }
+        if(memcontroller.pageHits < REPLACEMENT_K)
+            return false;
+    }
+    return true;
+}
+
+bool RmTest::ExecuteProgramTest_PagesInSwap_AreBroughtInWhenTouched()
+{
+    Cpu cpu = Cpu();
+    Program program = cpu.LoadProgram("small.txt");
+    int codePage = program.codeSegment.memory.usedPages[0];
+    int dataPage = program.dataSegment.memory.usedPages[0];
+    int stackPage = program.stackSegment.memory.usedPages[0];
+    for(int page : {codePage, dataPage, stackPage})
+    {
+        if(cpu.memcontroller.MoveToSwap(page) == -1)
+            return false;
+    }
+
+    // small.txt never touches its stack, so that page stays out, the run stops before its STOP
+    long long swapIns = cpu.memcontroller.swapIns;
+    program = cpu.ExecuteProgram(program, 12);
+    if(pageTable[codePage].onDisk || pageTable[dataPage].onDisk || !pageTable[stackPage].onDisk)
+        return false;
+    if(cpu.memcontroller.swapIns != swapIns + 2)
+        return false;
+
+    std::vector<int> expectedDataSegm = {97, 10, 98, 100, 99, 110};
+    for(int i = 0; i < expectedDataSegm.size(); i++)
+    {
+        if(cpu.memcontroller.ReadRAM(program.dataSegment.memory.addresses[i]) != expectedDataSegm[i])
+            return false;
+    }
+
+    // once it stops its pages are freed, the one left in swap gives its sector back
+    program = cpu.ExecuteProgram(program);
+    if(pageTable[codePage].used || pageTable[dataPage].used || pageTable[stackPage].used)
+        return false;
+    return !pageTable[stackPage].onDisk && pageTable[stackPage].swapSector != -1;
+}
+
+bool RmTest::PrefetchTest_WorkingSetPages_AreSwappedInAhead()
+{
+    Memcontrol memcontroller = Memcontrol();
+    Memory memory = memcontroller.AllocateMemory(PAGE_SIZE * 2);
+    int touched = memory.usedPages[0];
+    int idle = memory.usedPages[1];
+    memcontroller.FlushTlb();
+    memcontroller.EndSlice(); // clearing the pages touched both, in the slice of the clock's program
+
+    // process 1 only touches the first page during its slice
+    memcontroller.activeProcessId = 1;
+    memcontroller.WriteRAM((touched << 12) + 5, 1234);
+    memcontroller.EndSlice();
+    if(memcontroller.WorkingSet(1) != std::vector<int>{touched})
+        return false;
+
+    memcontroller.MoveToSwap(touched);
+    memcontroller.MoveToSwap(idle);
+    memcontroller.Prefetch(1);
+    memcontroller.CompletePrefetch(1);
+    if(pageTable[touched].onDisk || !pageTable[idle].onDisk || memcontroller.prefetchedPages != 1)
+        return false;
+
+    // no fault is left for the page that came in ahead of time
+    long long faults = memcontroller.pageFaults;
+    if(memcontroller.ReadRAM((touched << 12) + 5) != 1234 || memcontroller.pageFaults != faults)
+        return false;
+
+    // a page freed while its read runs is left alone
+    memcontroller.MoveToSwap(touched);
+    memcontroller.Prefetch(1);
+    memcontroller.FreeMemory({{touched}, AddressList({touched})});
+    memcontroller.CompletePrefetch(1);
+    return memcontroller.prefetchedPages == 1 && pageTable[touched].frame == -1 && !pageTable[touched].onDisk;
+}
+
+bool RmTest::ExecuteProgramTest_FaultInFusedRun_RetiresOnlyCompletedInstructions()
+{
+    // loadv / storer / int runs whose loadv faults once the data page is sent to swap
+    std::vector<int> code = {VAR, 'a', LOADI, 5, STOREV, 'a', LOADV, 'a', STORER, 'x', INT, 1, INC,
+        STOREV, 'a', JMP, 6};
+    auto swapData = [](Cpu &cpu, Program &program, int run)
+    {
+        if(run == 0)
+            cpu.memcontroller.MoveToSwap(program.dataSegment.memory.usedPages[0]);
+    };
+
+    std::vector<long long> switched = RunOnEngine(code, ENGINE_SWITCH, 20, 2, swapData);
+    return switched == RunOnEngine(code, ENGINE_THREADED, 20, 2, swapData) && switched[0] == 40;
+}
+
+bool RmTest::ForkProcessTest_WhenProcessStops_ItsPagesAreFreed()
+{
+    Cpu cpu = Cpu();
+    processList.clear();
+    Program program = cpu.LoadProgram(std::vector<int>{STOP});
+    std::vector<int> pages;
+    for(Segment *segment : {&program.codeSegment, &program.dataSegment, &program.stackSegment})
+        pages.insert(pages.end(), segment->memory.usedPages.begin(), segment->memory.usedPages.end());
+
+    // nothing else is ready, so the machine halts once the process is gone
+    int id = cpu.memcontroller.ForkProcess({"stopper"}, program);
+    cpu.EnterProgram(program);
+    cpu.memcontroller.activeProcessId = id;
+    cpu.Run(10);
+
+    bool result = processList[id].status == 0;
+    for(int page : pages)
+    {
+        if(pageTable[page].used)
+            result = false;
+    }
+    processList.clear();
+    return result;
+}
+
+bool RmTest::ForkProcessTest_WhenHeapRunsOut_ProcessIsKilled()
+{
+    Cpu cpu = Cpu();
+    processList.clear();
+    HeapBlockHandlers.clear();
+    Program program = cpu.LoadProgram(std::vector<int>{STR, 'a', 'b', 'c', 0, JMP, 0});
+    int id = cpu.memcontroller.ForkProcess({"hog"}, program);
+    cpu.EnterProgram(program);
+    cpu.memcontroller.activeProcessId = id;
+
+    // the process filling the heap is killed instead of the machine
+    CpuEvent event = EVENT_BUDGET;
+    for(int i = 0; i < 100 && event == EVENT_BUDGET; i++)
+        event = cpu.Run(100000);
+    bool result = event == EVENT_HALT && processList[id].status == 0;
+
+    // and its blocks are back on the heap
+    HeapBlockHandler block = cpu.memcontroller.HeapAlloc(-1, HEAP_SIZE / 2);
+    cpu.memcontroller.HeapFree(block.start);
+    processList.clear();
+    return result;
+}
+
+bool RmTest::ForkProcessTest_WhenLaunchedTwice_CodeIsShared()
+{
+    Cpu cpu = Cpu();
+    processList.clear();
+    cpu.iocontroller.modifyDriveData({1453, 2, 'p', 0, 3, INC, JMP, 0, -2}); // names are stored with their terminator
+
+    // launches p twice while the first copy is still around, with an argument like the shell passes
+    Program program = cpu.LoadProgram(std::vector<int>{STR, 'p', ' ', 'a', 0, STORER, 'x', STORER, 'c', INT, 3,
+        LOADR, 'x', STORER, 'c', INT, 3, STOP});
+    cpu.ExecuteProgram(program);
+
+    bool result = processList.size() == 2;
+    if(result)
+    {
+        int first = processList[0].program.codeSegment.memory.usedPages[0];
+        int second = processList[1].program.codeSegment.memory.usedPages[0];
+        result = first != second && pageTable[first].frame == pageTable[second].frame;
+    }
+
+    // after the drive is written, even with the same code, p is loaded again
+    cpu.iocontroller.modifyDriveData({1453, 2, 'p', 0, 3, INC, JMP, 0, -2});
+    program = cpu.LoadProgram(std::vector<int>{STR, 'p', ' ', 'a', 0, STORER, 'c', INT, 3, STOP});
+    cpu.ExecuteProgram(program);
+    if(result)
+    {
+        result = processList.size() == 3 && pageTable[processList[2].program.codeSegment.memory.usedPages[0]].frame !=
+            pageTable[processList[0].program.codeSegment.memory.usedPages[0]].frame;
+    }
+
+    processList.clear();
+    remove(DRIVE);
+    programImages.clear();
+    return result;
+}
+
+bool RmTest::FlagsTest_LazyFlags_MatchEagerFlags()
+{
+    // fs as the flags came out when every result was folded in right away and parity
+    // counted the set bits of the accumulator
+    std::vector<std::pair<std::vector<int>, int>> cases = {
+        {{LOADI, 0, DEC, STOP}, sf | ef},                         // negative, even parity
+        {{LOADI, 0, SUBI, 48 - 3, STOP}, sf | pf | ef},           // negative, odd parity
+        {{LOADI, 1, DEC, STOP}, zf | ef},
+        {{LOADI, 2, ADDI, 48 + 5, STOP}, pf | ef},
+        {{LOADI, 1, DEC, INC, INC, STOP}, zf | pf | ef},          // a pending zero is folded in when replaced
+        {{LOADI, 0, DEC, INC, INC, STOP}, sf | zf | pf | ef},     // fs has every bit, later results are dropped
+        {{LOADI, 7, CMPI, 9, STOP}, lf | pf | ef},
+        {{LOADI, 3, CMPI, 5, CMPI, 3, STOP}, lf | zf | ef},
+        {{LOADI, 1, DEC, JNZ, 6, INC, STOP}, pf | ef},            // JNZ sees the pending zero, falls through and toggles zf
+        {{LOADI, 0, DEC, JNZ, 6, STOP, INC, STOP}, sf | zf | ef}, // and jumps without one
+        {{LOADI, 20, DEC, JZ, 7, JMP, 2, STOP}, zf | pf | ef}     // hot enough to be compiled
+    };
+    ExecutionEngine engines[] = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT};
+    const int fsIndex = 6; // where RunOnEngine puts fs
+
+    for(auto &test : cases)
+    {
+        for(ExecutionEngine engine : engines)
+        {
+            // in one go, and an instruction at a time so every result is pending across a snapshot
+            if(RunOnEngine(test.first, engine, 1000)[fsIndex] != test.second)
+                return false;
+            if(RunOnEngine(test.first, engine, 1, 100)[fsIndex] != test.second)
+                return false;
+        }
+    }
+
+    return true;
+}
+
 bool RmTest::LoadProgramTest_GivenSeveralPrograms_LoadedSuccesfully()
 {
     Cpu cpu = Cpu();
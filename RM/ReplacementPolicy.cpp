@@ -0,0 +1,223 @@
+#include "ReplacementPolicy.h"
+#include <algorithm>
+
+ReplacementPolicy::ReplacementPolicy()
+{
+    Reset();
+}
+
+void ReplacementPolicy::Reset()
+{
+    prev.fill(-1);
+    next.fill(-1);
+    listOf.fill(NO_LIST);
+    references.fill(0);
+    heads.fill(-1);
+    sizes.fill(0);
+    target = 0;
+}
+
+const char *ReplacementPolicy::Name() const
+{
+    switch(kind)
+    {
+        case REPLACE_LRU2:
+            return "lru2";
+        case REPLACE_ARC:
+            return "arc";
+        default:
+            return "clock";
+    }
+}
+
+void ReplacementPolicy::Link(int page, int list)
+{
+    int head = heads[list];
+    if(head == -1)
+    {
+        prev[page] = page;
+        next[page] = page;
+        heads[list] = page;
+    }
+    else
+    {
+        // the tail sits right behind the head, and behind the CLOCK hand
+        prev[page] = prev[head];
+        next[page] = head;
+        next[prev[head]] = page;
+        prev[head] = page;
+    }
+    listOf[page] = list;
+    sizes[list]++;
+}
+
+void ReplacementPolicy::Unlink(int page)
+{
+    int list = listOf[page];
+    if(next[page] == page)
+    {
+        heads[list] = -1;
+    }
+    else
+    {
+        next[prev[page]] = next[page];
+        prev[next[page]] = prev[page];
+        if(heads[list] == page)
+            heads[list] = next[page];
+    }
+    listOf[page] = NO_LIST;
+    sizes[list]--;
+}
+
+void ReplacementPolicy::Inserted(int page)
+{
+    int list = listOf[page];
+    if(list == RECENT || list == FREQUENT)
+        return;
+
+    switch(kind)
+    {
+        case REPLACE_LRU2:
+            // pages keep their count while they are out in swap
+            if(list == GHOST_RECENT)
+                Unlink(page);
+            else
+                references[page] = 0;
+            Link(page, references[page] >= REPLACEMENT_K ? FREQUENT : RECENT);
+            break;
+        case REPLACE_ARC:
+            // a hit in a ghost list says which list should have been bigger
+            if(list == GHOST_RECENT)
+            {
+                target = std::min(FRAMETABLE_SIZE, target + std::max(sizes[GHOST_FREQUENT] / sizes[GHOST_RECENT], 1));
+                Unlink(page);
+                Link(page, FREQUENT);
+            }
+            else if(list == GHOST_FREQUENT)
+            {
+                target = std::max(0, target - std::max(sizes[GHOST_RECENT] / sizes[GHOST_FREQUENT], 1));
+                Unlink(page);
+                Link(page, FREQUENT);
+            }
+            else
+            {
+                Link(page, RECENT);
+            }
+            break;
+        default:
+            references[page] = 0;
+            Link(page, RECENT);
+            break;
+    }
+}
+
+void ReplacementPolicy::Removed(int page, bool swapped)
+{
+    int list = listOf[page];
+    if(list == NO_LIST)
+        return;
+    if(list != RECENT && list != FREQUENT)
+    {
+        // ghosts are only remembered while the page stays in swap
+        if(!swapped)
+            Unlink(page);
+        return;
+    }
+
+    Unlink(page);
+    if(!swapped || kind == REPLACE_CLOCK)
+        return;
+
+    if(kind == REPLACE_LRU2)
+    {
+        Link(page, GHOST_RECENT);
+        if(sizes[GHOST_RECENT] > FRAMETABLE_SIZE)
+            Unlink(heads[GHOST_RECENT]);
+        return;
+    }
+
+    // ARC keeps T1 and B1 within the frame count and all four lists within twice that
+    Link(page, list == RECENT ? GHOST_RECENT : GHOST_FREQUENT);
+    if(sizes[RECENT] + sizes[GHOST_RECENT] > FRAMETABLE_SIZE)
+        Unlink(heads[GHOST_RECENT]);
+    if(sizes[RECENT] + sizes[FREQUENT] + sizes[GHOST_RECENT] + sizes[GHOST_FREQUENT] > 2 * FRAMETABLE_SIZE && heads[GHOST_FREQUENT] != -1)
+        Unlink(heads[GHOST_FREQUENT]);
+}
+
+void ReplacementPolicy::Referenced(int page)
+{
+    int list = listOf[page];
+    if(list != RECENT && list != FREQUENT)
+        return;
+
+    switch(kind)
+    {
+        case REPLACE_LRU2:
+            // pages short of K references stay in the order they came in
+            references[page] = std::min(references[page] + 1, REPLACEMENT_K);
+            if(list == FREQUENT || references[page] == REPLACEMENT_K)
+            {
+                Unlink(page);
+                Link(page, FREQUENT);
+            }
+            break;
+        case REPLACE_ARC:
+            Unlink(page);
+            Link(page, FREQUENT);
+            break;
+        default:
+            references[page] = 1;
+            break;
+    }
+}
+
+int ReplacementPolicy::FirstUnpinned(int list, const std::bitset<PAGETABLE_SIZE> &pinned)
+{
+    int page = heads[list];
+    for(int i = 0; i < sizes[list]; i++, page = next[page])
+    {
+        if(!pinned.test(page))
+            return page;
+    }
+    return -1;
+}
+
+// The hand clears reference bits as it passes, so it stops within two turns
+int ReplacementPolicy::ClockVictim(const std::bitset<PAGETABLE_SIZE> &pinned)
+{
+    for(int i = 0; i < 2 * sizes[RECENT]; i++)
+    {
+        int page = heads[RECENT];
+        heads[RECENT] = next[page];
+        if(pinned.test(page))
+            continue;
+        if(references[page] != 0)
+        {
+            references[page] = 0;
+            continue;
+        }
+        return page;
+    }
+    return -1;
+}
+
+int ReplacementPolicy::Victim(const std::bitset<PAGETABLE_SIZE> &pinned)
+{
+    switch(kind)
+    {
+        case REPLACE_LRU2:
+        {
+            int page = FirstUnpinned(RECENT, pinned);
+            return page != -1 ? page : FirstUnpinned(FREQUENT, pinned);
+        }
+        case REPLACE_ARC:
+        {
+            // T1 gives up a page while it is over its target share
+            bool recentFirst = sizes[RECENT] > target || sizes[FREQUENT] == 0;
+            int page = FirstUnpinned(recentFirst ? RECENT : FREQUENT, pinned);
+            return page != -1 ? page : FirstUnpinned(recentFirst ? FREQUENT : RECENT, pinned);
+        }
+        default:
+            return ClockVictim(pinned);
+    }
+}
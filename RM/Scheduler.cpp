@@ -0,0 +1,50 @@
+#include "Scheduler.h"
+
+void Scheduler::Add(int id)
+{
+    runQueue.push_back(id);
+}
+
+int Scheduler::Next()
+{
+    if(runQueue.empty())
+        return NO_PROCESS;
+
+    int id = runQueue.front();
+    runQueue.pop_front();
+    return id;
+}
+
+int Scheduler::Peek() const
+{
+    return runQueue.empty() ? NO_PROCESS : runQueue.front();
+}
+
+bool Scheduler::HasReady()
+{
+    return !runQueue.empty();
+}
+
+void Scheduler::Wait(int id, int child)
+{
+    waiting[child].push_back(id);
+}
+
+void Scheduler::Exited(int id)
+{
+    auto waiters = waiting.find(id);
+    if(waiters == waiting.end())
+        return;
+
+    for(int waiter : waiters->second)
+    {
+        Add(waiter);
+    }
+    waiting.erase(waiters);
+}
+
+void Scheduler::Clear()
+{
+    runQueue.clear();
+    waiting.clear();
+}
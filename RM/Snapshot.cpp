@@ -0,0 +1,310 @@
+#include "cpu.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <stdexcept>
+
+// Machine snapshots are raw host-endian dumps, they are only meant to be
+// restored by the same build on the same machine
+
+class SnapshotWriter
+{
+    public:
+        SnapshotWriter(std::string filename) : out(filename, std::ios::binary | std::ios::trunc) {}
+
+        bool Good() { return out.good(); }
+
+        template<typename T> void Raw(const T &value)
+        {
+            out.write((const char*)&value, sizeof(T));
+        }
+
+        void Bytes(const void *data, size_t size)
+        {
+            out.write((const char*)data, size);
+        }
+
+        void Ints(const std::vector<int> &values)
+        {
+            Raw((int)values.size());
+            Bytes(values.data(), values.size() * sizeof(int));
+        }
+
+        void String(const std::string &value)
+        {
+            Raw((int)value.size());
+            Bytes(value.data(), value.size());
+        }
+
+        void Program(const ::Program &program)
+        {
+            for(const Segment *segment : {&program.codeSegment, &program.stackSegment, &program.dataSegment})
+            {
+                Ints(segment->memory.usedPages);
+                Raw(segment->writePointer);
+                Raw(segment->startPointer);
+                Raw(segment->direction);
+            }
+            Raw(program.cpuSnapshot);
+            Raw(program.cycles);
+            Raw((int)program.variables.size());
+            for(auto &variable : program.variables)
+            {
+                Raw(variable.first);
+                Raw(variable.second);
+            }
+        }
+
+    private:
+        std::ofstream out;
+};
+
+class SnapshotReader
+{
+    public:
+        SnapshotReader(const char *data, size_t size) : data(data), size(size) {}
+
+        const char *Take(size_t count)
+        {
+            if(count > size - offset)
+                throw std::runtime_error("Machine snapshot is truncated");
+            const char *start = data + offset;
+            offset += count;
+            return start;
+        }
+
+        template<typename T> T Raw()
+        {
+            T value;
+            memcpy(&value, Take(sizeof(T)), sizeof(T));
+            return value;
+        }
+
+        void Bytes(void *destination, size_t count)
+        {
+            memcpy(destination, Take(count), count);
+        }
+
+        std::vector<int> Ints()
+        {
+            std::vector<int> values(Raw<int>());
+            Bytes(values.data(), values.size() * sizeof(int));
+            return values;
+        }
+
+        std::string String()
+        {
+            int length = Raw<int>();
+            return std::string(Take(length), length);
+        }
+
+        // Address lists are not stored, they follow from the pages
+        ::Program Program(Memcontrol &memcontroller)
+        {
+            ::Program program;
+            for(Segment *segment : {&program.codeSegment, &program.stackSegment, &program.dataSegment})
+            {
+                segment->memory.usedPages = Ints();
+                segment->memory.addresses = AddressList(segment->memory.usedPages);
+                segment->writePointer = Raw<int>();
+                segment->startPointer = Raw<int>();
+                segment->direction = Raw<char>();
+            }
+            program.cpuSnapshot = Raw<CpuSnapshot>();
+            program.cycles = Raw<long long>();
+            for(int variables = Raw<int>(); variables > 0; variables--)
+            {
+                int id = Raw<int>();
+                program.variables[id] = Raw<int>();
+            }
+            return program;
+        }
+
+    private:
+        const char *data;
+        size_t size;
+        size_t offset = 0;
+};
+
+void Cpu::SaveMachine(std::string filename)
+{
+    SnapshotWriter out(filename);
+    if(!out.Good())
+        throw std::runtime_error("Could not write machine snapshot " + filename);
+
+    out.Raw(SNAPSHOT_MAGIC);
+    out.Raw(SNAPSHOT_VERSION);
+
+    memcontroller.FlushTlb();
+    out.Bytes(RAM.data(), sizeof(RAM));
+    out.Bytes(pageTable.data(), sizeof(pageTable));
+    out.Bytes(frameTable.data(), sizeof(frameTable));
+
+    // swapped out pages live in files of their own, they go into the snapshot too
+    for(int i = 0; i < PAGETABLE_SIZE; i++)
+    {
+        if(pageTable[i].onDisk && pageTable[i].swapSector != -1)
+        {
+            out.Raw(pageTable[i].swapSector);
+            out.Raw(iocontroller.PeekSwapData(pageTable[i].swapSector));
+        }
+    }
+    out.Raw(-1);
+
+    out.Raw((int)HeapBlockHandlers.size());
+    for(const HeapBlockHandler &block : HeapBlockHandlers)
+    {
+        out.Raw(block);
+    }
+
+    out.Raw((int)processList.size());
+    for(const Process &process : processList)
+    {
+        out.Raw(process.id);
+        out.String(process.name);
+        out.Program(process.program);
+        out.Raw((int)process.args.size());
+        for(const std::string &arg : process.args)
+        {
+            out.String(arg);
+        }
+        out.Raw(process.parent);
+        out.Raw(process.firstChild);
+        out.Raw(process.nextSibling);
+        out.Raw(process.status);
+    }
+
+    out.Ints(scheduler.Ready());
+    out.Raw((int)scheduler.Waiting().size());
+    for(auto &child : scheduler.Waiting())
+    {
+        out.Raw(child.first);
+        out.Ints(child.second);
+    }
+    out.Raw(scheduler.quantum);
+
+    out.Raw(memcontroller.activeProcessId);
+    out.Raw(memcontroller.pageFaults);
+    out.Raw(memcontroller.pageHits);
+    out.Raw(memcontroller.swapIns);
+    out.Raw(memcontroller.swapOuts);
+    out.Raw(memcontroller.heapBytesAllocated);
+
+    Program active = activeProgram;
+    active.cpuSnapshot = SaveToSnapshot();
+    active.cycles += instructionsRetired - contextStart;
+    out.Program(active);
+    out.Program(bootContext);
+    out.Raw(instructionsRetired);
+
+    if(!out.Good())
+        throw std::runtime_error("Could not write machine snapshot " + filename);
+}
+
+bool Cpu::RestoreMachine(std::string filename)
+{
+    int file = open(filename.c_str(), O_RDONLY);
+    if(file == -1)
+        return false;
+
+    struct stat info;
+    if(fstat(file, &info) == -1 || info.st_size == 0)
+    {
+        close(file);
+        return false;
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(mapping == MAP_FAILED)
+        return false;
+
+    SnapshotReader in((const char*)mapping, info.st_size);
+    try
+    {
+        if(in.Raw<int>() != SNAPSHOT_MAGIC || in.Raw<int>() != SNAPSHOT_VERSION)
+        {
+            munmap(mapping, info.st_size);
+            return false;
+        }
+
+        memcontroller.CancelPrefetch();
+        memcontroller.FlushTlb();
+        in.Bytes(RAM.data(), sizeof(RAM));
+        in.Bytes(pageTable.data(), sizeof(pageTable));
+        translationEpoch++;
+        pageStateEpoch++;
+        in.Bytes(frameTable.data(), sizeof(frameTable));
+
+        for(int sector = in.Raw<int>(); sector != -1; sector = in.Raw<int>())
+        {
+            iocontroller.WriteSwapData(sector, in.Raw<std::array<int, PAGE_SIZE>>());
+        }
+
+        HeapBlockHandlers.resize(in.Raw<int>());
+        for(HeapBlockHandler &block : HeapBlockHandlers)
+        {
+            block = in.Raw<HeapBlockHandler>();
+        }
+        memcontroller.RebuildHeapIndex();
+
+        processList.resize(in.Raw<int>());
+        for(Process &process : processList)
+        {
+            process.id = in.Raw<int>();
+            process.name = in.String();
+            process.program = in.Program(memcontroller);
+            process.args.resize(in.Raw<int>());
+            for(std::string &arg : process.args)
+            {
+                arg = in.String();
+            }
+            process.parent = in.Raw<int>();
+            process.firstChild = in.Raw<int>();
+            process.nextSibling = in.Raw<int>();
+            process.status = in.Raw<int>();
+        }
+
+        scheduler.Clear();
+        for(int id : in.Ints())
+        {
+            scheduler.Add(id);
+        }
+        for(int children = in.Raw<int>(); children > 0; children--)
+        {
+            int child = in.Raw<int>();
+            for(int id : in.Ints())
+            {
+                scheduler.Wait(id, child);
+            }
+        }
+        scheduler.quantum = in.Raw<int>();
+
+        memcontroller.activeProcessId = in.Raw<int>();
+        memcontroller.pageFaults = in.Raw<long long>();
+        memcontroller.pageHits = in.Raw<long long>();
+        memcontroller.swapIns = in.Raw<long long>();
+        memcontroller.swapOuts = in.Raw<long long>();
+        memcontroller.heapBytesAllocated = in.Raw<long long>();
+
+        activeProgram = in.Program(memcontroller);
+        bootContext = in.Program(memcontroller);
+        instructionsRetired = in.Raw<long long>();
+    }
+    catch(...)
+    {
+        munmap(mapping, info.st_size);
+        throw;
+    }
+    munmap(mapping, info.st_size);
+
+    SetFromSnapshot(activeProgram.cpuSnapshot);
+    retReg = activeProgram.cpuSnapshot.retReg;
+    contextStart = instructionsRetired;
+    decodedPrograms.clear();
+    loadedPrograms.clear();
+    decoded = GetDecodedProgram(activeProgram);
+    return true;
+}
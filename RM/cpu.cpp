@@ -17,71 +17,6 @@
 
 
 
-// Instruction definition
-enum
-{
-    STOP = 0,
-    LOADA,
-    LOADI,
-    LOADR,
-    STOREA,
-    STORER,
-    ADDA,
-    ADDI,
-    ADDR,
-    SUBA,
-    SUBI,
-    SUBR,
-    MULA,
-    MULI,
-    MULR,
-    DIVA,
-    DIVI,
-    DIVR,
-    JZ,
-    JNZ,
-    JL,
-    JLE,
-    JG,
-    JGE,
-    JMP,
-    MOD,
-    PUSH,
-    POP,
-    INC,
-    DEC,
-    SHL,
-    SHR,
-    INT,
-    ANDA,
-    ANDI,
-    ANDR,
-    ORA,
-    ORI,
-    ORR,
-    XORA,
-    XORI,
-    XORR,
-    CMPA,
-    CMPI,
-    CMPR,
-    CALL,
-    VAR,
-    PTR,
-    LOADV,
-    LOADP,
-    STOREP,
-    STOREV,
-    JO,
-    JP,
-    JC,
-    RET,
-    STR,
-    RSTR,
-    DELSTR,
-    STRCAT
-};
-
 void Cpu::OP_STOP()
 {
     if(xReg == 9000 && cReg == 9000)
@@ -93,16 +28,52 @@ void Cpu::OP_STOP()
     {
         //TODO: kill current process, return to parent process
         //fs |= ef;
-        memcontroller.StopCurrentProcess();
-        activeProgram = processList[memcontroller.activeProcessId].program;   
-        SetFromSnapshot(activeProgram.cpuSnapshot);
+        if(memcontroller.activeProcessId == -1)
+        {
+            // Program was started directly, not as a process - nothing to return to
+            fs |= ef;
+            return;
+        }
+        EndCurrentProcess();
+    }
+}
+
+// The process never runs again, its pages and heap blocks go back before the
+// next ready process gets the cpu
+void Cpu::EndCurrentProcess()
+{
+    int stopped = memcontroller.activeProcessId;
+    memcontroller.StopCurrentProcess();
+    scheduler.Exited(stopped);
+    memcontroller.FreeProgram(activeProgram);
+    memcontroller.HeapFreeOwnedBy(stopped);
+
+    int next = scheduler.Next();
+    if(next == NO_PROCESS)
+    {
+        // nothing is left to run
+        fs |= ef;
+        return;
     }
+    SwitchTo(next);
+}
+
+// A process that cannot get memory is killed instead of the whole machine,
+// a program that is not a process leaves the error to its caller
+void Cpu::KillCurrentProcess(OutOfMemory *error)
+{
+    if(memcontroller.activeProcessId == -1)
+        throw error;
+
+    std::cout << processList[memcontroller.activeProcessId].name << " killed: " << error->what() << std::endl;
+    delete error;
+    EndCurrentProcess();
 }
 
 void Cpu::OP_STR()
 {
     std::string str = buildString();
-    auto memBlock = memcontroller.HeapAlloc(activeProgram, str.size());
+    auto memBlock = memcontroller.HeapAlloc(memcontroller.activeProcessId, str.size());
 
     memcontroller.StoreStringInHeap(memBlock, str);
     acc = memBlock.start;
@@ -112,19 +83,23 @@ void Cpu::OP_STR()
 void Cpu::OP_STRCAT()
 {
     std::string str = buildString();
-    HeapBlockHandler handle;
-    for(auto i : HeapBlockHandlers)
+    HeapBlockHandler handle = memcontroller.FindHeapBlock(xReg);
+    if(handle.size != -1)
+        xReg = 0;
+
+    // the base grows in place while its block has slack, so a string built in a loop is never copied again
+    if(memcontroller.HeapAppend(handle.start, str))
     {
-        if(i.start = xReg)
-        {
-            handle = i;
-            xReg = 0;
-            break;
-        }
+        acc = handle.start;
+        return;
     }
+
+    // otherwise it moves to a block with as much slack as it is long and the old block is given back
     std::string base = memcontroller.ReadStringFromHeap(handle);
+    base.pop_back();
     base += str;
-    auto memBlock = memcontroller.HeapAlloc(activeProgram, base.size());
+    memcontroller.HeapFree(handle.start);
+    auto memBlock = memcontroller.HeapAlloc(memcontroller.activeProcessId, base.size(), base.size());
 
     memcontroller.StoreStringInHeap(memBlock, base);
     acc = memBlock.start;
@@ -137,29 +112,73 @@ void Cpu::OP_RSTR()
 
 void Cpu::OP_DELSTR()
 {
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == acc)
-        {
-            memcontroller.HeapFree(&i);
-        }
-    }
+    memcontroller.HeapFree(acc);
+}
+
+void Cpu::OP_MEMCPY()
+{
+    memcontroller.CopyRAM(xReg, cReg, acc);
+    pc = current->nextPc;
+}
+
+void Cpu::OP_MEMSET()
+{
+    memcontroller.FillRAM(xReg, cReg, acc);
+    pc = current->nextPc;
+}
+
+void Cpu::OP_MEMCMP()
+{
+    acc = memcontroller.CompareRAM(xReg, cReg, acc);
+    UpdateFlags();
+    pc = current->nextPc;
+}
+
+void Cpu::OP_VADD()
+{
+    memcontroller.AddRAM(xReg, cReg, acc);
+    pc = current->nextPc;
+}
+
+void Cpu::OP_VMUL()
+{
+    memcontroller.MultiplyRAM(xReg, cReg, acc);
+    pc = current->nextPc;
+}
+
+void Cpu::OP_VSUM()
+{
+    acc = memcontroller.SumRAM(xReg, acc);
+    UpdateFlags();
+    pc = current->nextPc;
+}
+
+void Cpu::OP_VMIN()
+{
+    acc = memcontroller.MinRAM(xReg, acc);
+    UpdateFlags();
+    pc = current->nextPc;
+}
+
+void Cpu::OP_VMAX()
+{
+    acc = memcontroller.MaxRAM(xReg, acc);
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_LOADA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = RAM[addr];
-    pc++;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_LOADI()
 {
-    pc++;
-    int varVal = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    int varVal = current->operand;
     acc = varVal;
-    pc++;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_RET()
@@ -171,389 +190,295 @@ void Cpu::OP_RET()
 
 void Cpu::OP_LOADR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
     
     if(c == 'x')
         acc = xReg;
     else if(c == 'c')
         acc = cReg;
    
-    pc++;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_STOREA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     RAM[addr] = acc;
-    pc++;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_STORER()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         xReg = acc;
     else if(c == 'c')
         cReg = acc;
 
-    pc++;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ADDA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = AddInternal(RAM[addr], acc);
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ADDI()
 {
-    pc++;
-    acc = AddInternal(RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])]-48, acc);
+    acc = AddInternal(current->operand-48, acc);
     
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ADDR()
 {
-    pc++;  
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         acc = AddInternal(xReg, acc);
     else if(c == 'c')
         acc = AddInternal(cReg, acc);
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_SUBA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc -= RAM[addr];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_SUBI()
 {
-    pc++;
-    acc += RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])]-48;
+    acc += current->operand-48;
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_SUBR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         acc -= xReg;
     else if(c == 'c')
         acc -= cReg;
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_MULA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = MulInternal(RAM[addr], acc);
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_MULI()
 {
-    pc++;
-    acc = MulInternal(RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])]-48, acc);
+    acc = MulInternal(current->operand-48, acc);
     
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_MULR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         acc = MulInternal(xReg, acc);
     else if(c == 'c')
         acc = MulInternal(cReg, acc);
     
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_DIVA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = acc / RAM[addr];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_DIVI()
 {
-    pc++;
-    acc = acc / (RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])]-48);
+    acc = acc / (current->operand-48);
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_DIVR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         acc /= xReg;
     else if(c == 'c')
         acc /= cReg;
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_JZ()
 {
-    pc++;
+    MaterializeFlags();
     int a = fs&zf;
 
     if(a==2)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JNZ()
 {
-    pc++;
+    MaterializeFlags();
     int a = fs&zf;
     if(a != 2)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
     fs ^= zf;
 }
 
 void Cpu::OP_JL()
 {
-    pc++;
     if(sf)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JLE()
 {
-    pc++;
     if(sf || zf)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JG()
 {
-    pc++;
     if(!sf)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     } 
 }
 
 void Cpu::OP_JGE()
 {
-    pc++;
     if(!sf || zf)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JO()
 {
-    pc++;
     if(of)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JP()
 {
-    pc++;
     if(pf)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JC()
 {
-    pc++;
     if(cf)
     {
-        uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        uint8_t offset = current->operand;
         pc = offset;
     }
     else
     {
-        pc++;
+        pc = current->nextPc;
     }
 }
 
 void Cpu::OP_JMP()
 {
-    pc++;
-    uint8_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    pc++;
+    uint8_t offset = current->operand;
     pc = offset;
 }
 
 void Cpu::OP_MOD()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = acc / RAM[memcontroller.ConvertToPhysAddress(addr)];
     if(acc < 0)
         fs |= sf;
     if(acc == 0)
         fs |= zf;
-    pc++;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_PUSH()
 {
-    pc++;
     int a = memcontroller.ConvertToPhysAddress(sp);
+    pc++;
     addr = a;
     RAM[addr] = acc;
     sp -= 1;
@@ -561,41 +486,33 @@ void Cpu::OP_PUSH()
 
 void Cpu::OP_POP()
 {
+    // translate first so a page fault leaves the registers untouched
+    int a = memcontroller.ConvertToPhysAddress(sp+1);
     pc++;
     sp++;
     addr = sp;
-    acc = RAM[memcontroller.ConvertToPhysAddress(addr)];
+    acc = RAM[a];
 }
 
 void Cpu::OP_INC()
 {
     pc++;
     acc++;
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
+    UpdateFlags();
 }
 
 void Cpu::OP_DEC()
 {
     pc++;
     acc--;
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
+    UpdateFlags();
 }
 
 void Cpu::OP_INT()
 {
     // TODO: Implement mapping to int handlers
-    pc++;
-    int sw = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    int sw = current->operand;
+    pc = current->nextPc;
     switch(sw)
     {
         case 1:
@@ -642,183 +559,118 @@ void Cpu::OP_INT()
         case 36:
             int36();
             break;
+        case 37:
+            int37();
+            break;
         default:
             throw std::runtime_error("Bad interrupt");
     }
-    pc++;
 }
 
 void Cpu::OP_ANDA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = acc & RAM[addr];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ANDI()
 {
-    pc++;
-    acc = acc & RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    acc = acc & current->operand;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ANDR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         xReg &= acc;
     else if(c == 'c')
         cReg &= acc;
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ORA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = acc | RAM[addr];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ORI()
 {
-    pc++;
-    acc = acc | RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    acc = acc | current->operand;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_ORR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         xReg |= acc;
     else if(c == 'c')
         cReg |= acc;
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_XORA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     acc = acc ^ RAM[addr];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_XORI()
 {
-    pc++;
-    acc = acc ^ RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    acc = acc ^ current->operand;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_XORR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
 
     if(c == 'x')
         xReg ^= acc;
     else if(c == 'c')
         cReg ^= acc;
 
-    if(acc < 0)
-        fs |= sf;
-    if(acc == 0)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateFlags();
+    pc = current->nextPc;
 }
 
 void Cpu::OP_CMPA()
 {
-    pc++;
-    addr = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    addr = current->operand;
     uint16_t val = RAM[addr];
     
-    if(acc < val)
-        fs |= lf;
-    if(acc == val)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateCompareFlags(val);
+    pc = current->nextPc;
 }
 
 void Cpu::OP_CMPI()
 {
-    pc++;
-    uint16_t val = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    uint16_t val = current->operand;
     
-    if(acc < val)
-        fs |= lf;
-    if(acc == val)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateCompareFlags(val);
+    pc = current->nextPc;
 }
 
 void Cpu::OP_CMPR()
 {
-    pc++;
-    char c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    char c = current->operand;
     uint16_t val;
     
     if(c == 'x')
@@ -826,53 +678,45 @@ void Cpu::OP_CMPR()
     else if(c == 'c')
         val = cReg;
 
-    if(acc < val)
-        fs |= lf;
-    if(acc == val)
-        fs |= zf;
-    if(ParityCheck())
-        fs |= pf;
-    pc++;
+    UpdateCompareFlags(val);
+    pc = current->nextPc;
 }
 
 void Cpu::OP_CALL()
 {
-    pc++;
-    uint16_t offset = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    pc++;
-    retReg = pc;
+    uint16_t offset = current->operand;
+    retReg = current->nextPc;
     pc = offset;
 }
 
 void Cpu::OP_SHR()
 {
-    pc++;
-    acc >> RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    pc++;
+    acc >> current->operand;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_SHL()
 {
-    pc++;
-    acc << RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-    pc++;
+    acc << current->operand;
+    pc = current->nextPc;
 }
 
 void Cpu::OP_VAR()
 {
-    pc++;
-    int x = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
+    int x = current->operand;
     int oldVarAddr = memcontroller.GetVarAddrIfExists(activeProgram, x);
     
     if(oldVarAddr != -1)
     {
-        pc++;
+        pc = current->nextPc;
     }
     else{
+        // the slot is written before anything else changes, a page fault restarts VAR cleanly
         int varAddr = activeProgram.dataSegment.writePointer;
-        RAM[varAddr] = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        RAM[varAddr+1] = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        pc++;
+        memcontroller.WriteRAM(varAddr, current->operand);
+        memcontroller.WriteRAM(varAddr+1, current->operand);
+        pc = current->nextPc;
+        activeProgram.variables[x] = varAddr - activeProgram.dataSegment.startPointer;
         activeProgram.dataSegment.writePointer += 2; 
     }
 }
@@ -891,18 +735,16 @@ void Cpu::OP_LOADP()
 
 void Cpu::OP_LOADV()
 {
-    pc++;
-    int addr = memcontroller.FindVarAddress(activeProgram, RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])]);
-    acc = RAM[addr+1];
-    pc++;
+    int addr = memcontroller.FindVarAddress(activeProgram, current->operand);
+    acc = RAM[memcontroller.ConvertToPhysAddress(addr+1)];
+    pc = current->nextPc;
 }
 
 void Cpu::OP_STOREV()
 {
-    pc++;
-    int addr = memcontroller.FindVarAddress(activeProgram, RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])]);
-    RAM[addr+1] = acc;
-    pc++;
+    int addr = memcontroller.FindVarAddress(activeProgram, current->operand);
+    memcontroller.WriteRAM(addr+1, acc);
+    pc = current->nextPc;
 }
 
 void Cpu::OP_STOREP()
@@ -920,8 +762,11 @@ void Cpu::UNDEFINED()
 // get the next instruction
 void Cpu::Fetch()
 {
-    int nextAddr = memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc]);
-    ir = RAM[nextAddr];
+    // a negative pc wraps around to an index past the end
+    if((size_t)pc >= decoded->instructions.size())
+        throw std::runtime_error("Program counter is outside of the code segment");
+    current = &decoded->instructions[pc];
+    ir = current->opcode;
 }
 
 // decode the instruction 
@@ -1109,28 +954,920 @@ void Cpu::Decode()
     case (STRCAT):
         OP_STRCAT();
         break;
+    case(MEMCPY):
+        OP_MEMCPY();
+        break;
+    case(MEMSET):
+        OP_MEMSET();
+        break;
+    case(MEMCMP):
+        OP_MEMCMP();
+        break;
+    case(VADD):
+        OP_VADD();
+        break;
+    case(VMUL):
+        OP_VMUL();
+        break;
+    case(VSUM):
+        OP_VSUM();
+        break;
+    case(VMIN):
+        OP_VMIN();
+        break;
+    case(VMAX):
+        OP_VMAX();
+        break;
     default:
         UNDEFINED();
         break;
     }
 }
 
-// public functions
+// Interrupts that wait on the outside world end the run before they execute
+static bool IsBlockingInterrupt(const DecodedInstruction *instruction)
+{
+    return instruction->opcode == INT && instruction->operand == 5;
+}
 
-void Cpu::ShowRam()
+// Reference engine: fetch from the decoded image and dispatch through the Decode switch
+CpuEvent Cpu::RunSwitch(int cycles, int &c)
 {
-    printf("CODE: (starting from %d)\n", memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[0]));
-    printf("[");
-    for(int i = 0; i < 50; i++)
+#ifdef GUEST_PROFILER
+    const DecodedProgram *profiled = nullptr;
+    GuestProfile *profile = nullptr;
+#endif
+    while(c < cycles)
     {
-        printf("%d, ", RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[i])]);
+        // interrupts running nested programs can end the machine too
+        if((fs & ef) != 0)
+            return EVENT_HALT;
+        Fetch();
+        if(IsBlockingInterrupt(current))
+            return EVENT_BLOCK;
+        if(profiling)
+        {
+            if(decoded->previousOpcode != -1)
+                decoded->pairCounts[{decoded->previousOpcode, ir}]++;
+            decoded->previousOpcode = ir;
+        }
+        c++;
+#ifdef GUEST_PROFILER
+        if(decoded != profiled)
+        {
+            profiled = decoded;
+            profile = &profiler.For(decoded->name);
+        }
+        int profiledPc = pc;
+        int fallthroughPc = current->nextPc;
+        profiler.Count(*profile, pc, ir);
+        bool conditional = (ir >= JZ && ir <= JGE) || (ir >= JO && ir <= JC);
+#endif
+        Decode();
+#ifdef GUEST_PROFILER
+        if(conditional)
+            profiler.CountJump(*profile, profiledPc, pc != fallthroughPc);
+#endif
+        if(ir == STOP)
+            return (fs & ef) != 0 ? EVENT_HALT : EVENT_STOP;
     }
-    printf("]\n");
+    return EVENT_BUDGET;
+}
 
-    printf("STACK: (starting from %d)\n", memcontroller.ConvertToPhysAddress(activeProgram.stackSegment.memory.addresses[activeProgram.stackSegment.memory.addresses.size()-1]));
-    printf("[");
-    for(int i = activeProgram.stackSegment.memory.addresses.size(); 
-    i > activeProgram.stackSegment.memory.addresses.size() - 50; i--)
+// Builds the handler tables of the active image the first time it is dispatched,
+// prepared is the JIT image the block heads were already set up for
+ThreadedTables Cpu::PrepareThreadedCode(const ThreadedHandlers &handlers, JitImage *prepared)
+{
+    int count = decoded->instructions.size();
+    if((int)decoded->threadedCode.size() != count)
+    {
+        decoded->threadedCode.resize(count);
+        for(int i = 0; i < count; i++)
+        {
+            int opcode = decoded->instructions[i].opcode;
+            decoded->threadedCode[i] = opcode >= 0 && opcode < handlers.opcodeCount ? handlers.opcodes[opcode] : handlers.undefined;
+            if(decoded->instructions[i].fused != FUSED_NONE)
+                decoded->threadedCode[i] = handlers.fused;
+        }
+    }
+
+    ThreadedTables tables;
+    tables.instructions = decoded->instructions.data();
+    tables.code = decoded->threadedCode.data();
+    tables.plainCode = tables.code;
+    tables.instructionCount = count;
+    tables.image = nullptr;
+    if(handlers.jitHead == nullptr)
+        return tables;
+
+    if(decoded->jitImage == nullptr)
+        decoded->jitImage = std::make_shared<JitImage>();
+    tables.image = decoded->jitImage.get();
+    if(tables.image != prepared)
+        jit.Prepare(*tables.image, decoded->instructions);
+    if((int)decoded->jitThreadedCode.size() != count)
+    {
+        decoded->jitThreadedCode = decoded->threadedCode;
+        for(int i = 0; i < count; i++)
+        {
+            if(tables.image->leaders[i])
+                decoded->jitThreadedCode[i] = handlers.jitHead;
+        }
+    }
+    tables.code = decoded->jitThreadedCode.data();
+    return tables;
+}
+
+// Direct-threaded engine. Every decoded instruction gets the address of its
+// handler label, the hot handlers are inlined here and dispatch jumps straight
+// from one handler to the next. Everything that may switch the active program
+// (interrupts, STOP) or is rare goes through the regular OP_* members, after
+// which the image is reloaded. With jitHeads the JIT's block heads dispatch
+// through a check that hands compiled and hot blocks back to RunJit.
+// Label addresses and computed gotos are a GNU extension, the engine is built on them
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+CpuEvent Cpu::RunThreaded(int cycles, int &c, bool jitHeads)
+{
+    static const void* handlers[] = {
+        &&op_STOP, &&op_LOADA, &&op_LOADI, &&op_LOADR, &&op_STOREA, &&op_STORER,
+        &&op_ADDA, &&op_ADDI, &&op_ADDR, &&op_SUBA, &&op_SUBI, &&op_SUBR,
+        &&op_MULA, &&op_MULI, &&op_MULR, &&op_DIVA, &&op_DIVI, &&op_DIVR,
+        &&op_JZ, &&op_JNZ, &&op_JL, &&op_JLE, &&op_JG, &&op_JGE, &&op_JMP,
+        &&op_MOD, &&op_PUSH, &&op_POP, &&op_INC, &&op_DEC, &&op_SHL, &&op_SHR,
+        &&op_INT, &&op_ANDA, &&op_ANDI, &&op_ANDR, &&op_ORA, &&op_ORI, &&op_ORR,
+        &&op_XORA, &&op_XORI, &&op_XORR, &&op_CMPA, &&op_CMPI, &&op_CMPR,
+        &&op_CALL, &&op_VAR, &&op_PTR, &&op_LOADV, &&op_LOADP, &&op_STOREP,
+        &&op_STOREV, &&op_JO, &&op_JP, &&op_JC, &&op_RET, &&op_STR, &&op_RSTR,
+        &&op_DELSTR, &&op_STRCAT, &&op_MEMCPY, &&op_MEMSET, &&op_MEMCMP,
+        &&op_VADD, &&op_VMUL, &&op_VSUM, &&op_VMIN, &&op_VMAX
+    };
+    const int handlerCount = sizeof(handlers)/sizeof(handlers[0]);
+
+    CpuEvent event = EVENT_BUDGET;
+    const DecodedInstruction *instructions = nullptr;
+    const void* const *threadedCode = nullptr;
+    const void* const *plainCode = nullptr; // threadedCode without the block head checks
+    JitImage *image = nullptr;
+    int instructionCount = 0;
+    const ThreadedHandlers threadedHandlers = {handlers, handlerCount, &&op_UNDEFINED, &&op_FUSED,
+        jitHeads ? &&op_JIT_HEAD : nullptr};
+
+// A new or replaced image always comes with vectors of its own
+#define RELOAD() \
+    do { \
+        if(decoded->instructions.data() != instructions || decoded->threadedCode.data() != plainCode) \
+        { \
+            ThreadedTables tables = PrepareThreadedCode(threadedHandlers, image); \
+            instructions = tables.instructions; \
+            threadedCode = tables.code; \
+            plainCode = tables.plainCode; \
+            instructionCount = tables.instructionCount; \
+            image = tables.image; \
+        } \
+    } while(0)
+
+#define DISPATCH() \
+    do { \
+        if(c >= cycles) \
+            goto done; \
+        if((fs & ef) != 0) \
+        { \
+            event = EVENT_HALT; \
+            goto done; \
+        } \
+        if(pc < 0 || pc >= instructionCount) \
+            throw std::runtime_error("Program counter is outside of the code segment"); \
+        current = &instructions[pc]; \
+        ir = current->opcode; \
+        c++; \
+        goto *threadedCode[pc]; \
+    } while(0)
+
+#define OUT_OF_LINE(handler) \
+    do { \
+        handler(); \
+        RELOAD(); \
+        DISPATCH(); \
+    } while(0)
+
+#define JUMP_IF(condition) \
+    do { \
+        if(condition) \
+            pc = (uint8_t)current->operand; \
+        else \
+            pc = current->nextPc; \
+        DISPATCH(); \
+    } while(0)
+
+    RELOAD();
+    DISPATCH();
+
+op_LOADA:
+    addr = current->operand;
+    acc = RAM[addr];
+    pc = current->nextPc;
+    DISPATCH();
+op_LOADI:
+    acc = current->operand;
+    pc = current->nextPc;
+    DISPATCH();
+op_LOADR:
+    OUT_OF_LINE(OP_LOADR);
+op_STOREA:
+    addr = current->operand;
+    RAM[addr] = acc;
+    pc = current->nextPc;
+    DISPATCH();
+op_STORER:
+    OUT_OF_LINE(OP_STORER);
+op_ADDA:
+    addr = current->operand;
+    acc = AddInternal(RAM[addr], acc);
+    UpdateFlags();
+    pc = current->nextPc;
+    DISPATCH();
+op_ADDI:
+    acc = AddInternal(current->operand-48, acc);
+    UpdateFlags();
+    pc = current->nextPc;
+    DISPATCH();
+op_ADDR:
+    OUT_OF_LINE(OP_ADDR);
+op_SUBA:
+    addr = current->operand;
+    acc -= RAM[addr];
+    UpdateFlags();
+    pc = current->nextPc;
+    DISPATCH();
+op_SUBI:
+    acc += current->operand-48;
+    UpdateFlags();
+    pc = current->nextPc;
+    DISPATCH();
+op_SUBR:
+    OUT_OF_LINE(OP_SUBR);
+op_MULA:
+    OUT_OF_LINE(OP_MULA);
+op_MULI:
+    OUT_OF_LINE(OP_MULI);
+op_MULR:
+    OUT_OF_LINE(OP_MULR);
+op_DIVA:
+    OUT_OF_LINE(OP_DIVA);
+op_DIVI:
+    OUT_OF_LINE(OP_DIVI);
+op_DIVR:
+    OUT_OF_LINE(OP_DIVR);
+op_JZ:
+    MaterializeFlags();
+    JUMP_IF((fs&zf) == 2);
+op_JNZ:
+    MaterializeFlags();
+    {
+        bool taken = (fs&zf) != 2;
+        fs ^= zf;
+        JUMP_IF(taken);
+    }
+op_JL:
+    JUMP_IF(sf);
+op_JLE:
+    JUMP_IF(sf || zf);
+op_JG:
+    JUMP_IF(!sf);
+op_JGE:
+    JUMP_IF(!sf || zf);
+op_JMP:
+    JUMP_IF(true);
+op_JO:
+    JUMP_IF(of);
+op_JP:
+    JUMP_IF(pf);
+op_JC:
+    JUMP_IF(cf);
+op_MOD:
+    OUT_OF_LINE(OP_MOD);
+op_PUSH:
+    OUT_OF_LINE(OP_PUSH);
+op_POP:
+    OUT_OF_LINE(OP_POP);
+op_INC:
+    pc++;
+    acc++;
+    UpdateFlags();
+    DISPATCH();
+op_DEC:
+    pc++;
+    acc--;
+    UpdateFlags();
+    DISPATCH();
+op_SHL:
+    OUT_OF_LINE(OP_SHL);
+op_SHR:
+    OUT_OF_LINE(OP_SHR);
+op_INT:
+    if(IsBlockingInterrupt(current))
+    {
+        c--;
+        event = EVENT_BLOCK;
+        goto done;
+    }
+    OUT_OF_LINE(OP_INT);
+op_ANDA:
+    OUT_OF_LINE(OP_ANDA);
+op_ANDI:
+    OUT_OF_LINE(OP_ANDI);
+op_ANDR:
+    OUT_OF_LINE(OP_ANDR);
+op_ORA:
+    OUT_OF_LINE(OP_ORA);
+op_ORI:
+    OUT_OF_LINE(OP_ORI);
+op_ORR:
+    OUT_OF_LINE(OP_ORR);
+op_XORA:
+    OUT_OF_LINE(OP_XORA);
+op_XORI:
+    OUT_OF_LINE(OP_XORI);
+op_XORR:
+    OUT_OF_LINE(OP_XORR);
+op_CMPA:
+    addr = current->operand;
+    UpdateCompareFlags(RAM[addr]);
+    pc = current->nextPc;
+    DISPATCH();
+op_CMPI:
+    UpdateCompareFlags(current->operand);
+    pc = current->nextPc;
+    DISPATCH();
+op_CMPR:
+    OUT_OF_LINE(OP_CMPR);
+op_CALL:
+    retReg = current->nextPc;
+    pc = (uint16_t)current->operand;
+    DISPATCH();
+op_RET:
+    if(retReg != -1)
+        pc = retReg;
+    retReg = -1;
+    DISPATCH();
+op_STOP:
+    OP_STOP();
+    event = (fs & ef) != 0 ? EVENT_HALT : EVENT_STOP;
+    goto done;
+op_VAR:
+    OUT_OF_LINE(OP_VAR);
+op_PTR:
+    OUT_OF_LINE(OP_PTR);
+op_LOADV:
+    OUT_OF_LINE(OP_LOADV);
+op_LOADP:
+    OUT_OF_LINE(OP_LOADP);
+op_STOREP:
+    OUT_OF_LINE(OP_STOREP);
+op_STOREV:
+    OUT_OF_LINE(OP_STOREV);
+op_STR:
+    OUT_OF_LINE(OP_STR);
+op_RSTR:
+    OUT_OF_LINE(OP_RSTR);
+op_DELSTR:
+    OUT_OF_LINE(OP_DELSTR);
+op_STRCAT:
+    OUT_OF_LINE(OP_STRCAT);
+op_MEMCPY:
+    OUT_OF_LINE(OP_MEMCPY);
+op_MEMSET:
+    OUT_OF_LINE(OP_MEMSET);
+op_MEMCMP:
+    OUT_OF_LINE(OP_MEMCMP);
+op_VADD:
+    OUT_OF_LINE(OP_VADD);
+op_VMUL:
+    OUT_OF_LINE(OP_VMUL);
+op_VSUM:
+    OUT_OF_LINE(OP_VSUM);
+op_VMIN:
+    OUT_OF_LINE(OP_VMIN);
+op_VMAX:
+    OUT_OF_LINE(OP_VMAX);
+op_UNDEFINED:
+    OUT_OF_LINE(UNDEFINED);
+op_FUSED:
+    // without budget for the whole run only its first instruction executes
+    if(cycles - c < current->fusedLength - 1)
+        goto *handlers[ir];
+    OUT_OF_LINE(ExecuteFused);
+op_JIT_HEAD:
+    // the instruction is not run here when RunJit can enter a block in its place
+    if(image->entries[pc] != nullptr ? cycles - c + 1 >= image->blockLengths[pc] :
+        image->heat[pc] >= 0 && ++image->heat[pc] >= JIT_HOT_THRESHOLD)
+    {
+        c--;
+        goto done;
+    }
+    // compiling depends only on the code, a head that failed once dispatches straight to its handler
+    if(image->heat[pc] < 0)
+        decoded->jitThreadedCode[pc] = plainCode[pc];
+    goto *plainCode[pc];
+
+done:
+    return event;
+
+#undef RELOAD
+#undef DISPATCH
+#undef OUT_OF_LINE
+#undef JUMP_IF
+}
+#pragma GCC diagnostic pop
+
+// Runs compiled blocks where the code is hot and the threaded engine
+// everywhere else, which comes back here at the next block head
+CpuEvent Cpu::RunJit(int cycles, int &c)
+{
+    if(!jit.Available())
+        return RunThreaded(cycles, c);
+
+    while(c < cycles)
+    {
+        if((fs & ef) != 0)
+            return EVENT_HALT;
+
+        if(decoded->jitImage == nullptr)
+            decoded->jitImage = std::make_shared<JitImage>();
+        JitImage &image = *decoded->jitImage;
+        jit.Prepare(image, decoded->instructions);
+
+        if(pc >= 0 && pc < (int)decoded->instructions.size())
+        {
+            const void *block = image.entries[pc];
+            if(block == nullptr && image.heat[pc] >= 0 && ++image.heat[pc] >= JIT_HOT_THRESHOLD)
+                block = jit.Compile(image, decoded->instructions, pc);
+
+            if(block != nullptr && cycles - c >= image.blockLengths[pc])
+            {
+                JitFrame frame;
+                frame.ram = RAM.data();
+                frame.entries = image.entries.data();
+                frame.entryCount = image.entries.size();
+                frame.budget = cycles - c;
+                frame.acc = acc;
+                MaterializeFlags();
+                frame.fs = fs;
+                frame.retReg = retReg;
+                frame.xReg = xReg;
+                frame.cReg = cReg;
+                frame.pc = pc;
+                frame.addr = addr;
+                frame.ir = ir;
+
+                jit.Enter(&frame, block);
+
+                c = cycles - frame.budget;
+                acc = frame.acc;
+                fs = frame.fs;
+                retReg = frame.retReg;
+                xReg = frame.xReg;
+                cReg = frame.cReg;
+                pc = frame.pc;
+                addr = frame.addr;
+                ir = frame.ir;
+                continue;
+            }
+        }
+
+        CpuEvent event = RunThreaded(cycles, c, true);
+        if(event != EVENT_BUDGET)
+            return event;
+    }
+    return EVENT_BUDGET;
+}
+
+// Decoded program images
+
+static int InstructionSize(int opcode)
+{
+    switch(opcode)
+    {
+    case(STOP):
+    case(PUSH):
+    case(POP):
+    case(INC):
+    case(DEC):
+    case(RET):
+    case(MEMCPY):
+    case(MEMSET):
+    case(MEMCMP):
+    case(VADD):
+    case(VMUL):
+    case(VSUM):
+    case(VMIN):
+    case(VMAX):
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+// Reads a null terminated STR/STRCAT literal starting at position,
+// leaves position on the word after the terminator
+static std::string DecodeString(const std::vector<int> &code, int &position)
+{
+    std::vector<char> contents;
+    int size = code.size();
+    char c = -1;
+    while(c != 0)
+    {
+        c = position < size ? code[position] : 0;
+        if(c == '\\')
+        {
+            c = position+1 < size ? code[position+1] : 0;
+            if(c == 'n')
+            contents.insert(contents.end(), '\n');
+            position+=2;
+        }
+        else if (c == '_')
+        {
+            c = ' ';
+            contents.insert(contents.end(), c);
+            position++;
+        }
+        else
+        {
+            contents.insert(contents.end(), c);
+            position++;
+        }
+    }
+    std::string str(contents.begin(), contents.end());
+    return str;
+}
+
+DecodedProgram Cpu::DecodeProgram(const std::vector<int> &code)
+{
+    DecodedProgram image;
+    int size = code.size();
+    image.instructions.resize(size);
+
+    // Every word gets an entry since jumps may land anywhere in the segment
+    for(int i = 0; i < size; i++)
+    {
+        DecodedInstruction &instruction = image.instructions[i];
+        instruction.opcode = code[i];
+        instruction.operand = i+1 < size ? code[i+1] : 0;
+        instruction.nextPc = i + InstructionSize(code[i]);
+
+        if(code[i] == STR || code[i] == STRCAT)
+        {
+            int position = i+1;
+            instruction.operand = image.strings.size();
+            image.strings.push_back(DecodeString(code, position));
+            instruction.nextPc = position;
+        }
+    }
+    return image;
+}
+
+std::vector<int> Cpu::ReadCodeSegment(const Program &program)
+{
+    // decoding needs the whole code segment, the pages are swapped in first
+    for(int page : program.codeSegment.memory.usedPages)
+    {
+        memcontroller.SwapIn(page, program.codeSegment.memory.usedPages);
+    }
+
+    std::vector<int> code;
+    const AddressList &addresses = program.codeSegment.memory.addresses;
+    int size = addresses.size();
+    code.reserve(size);
+    for(int i = 0; i < size; i++)
+    {
+        code.push_back(RAM[memcontroller.ConvertToPhysAddress(addresses[i])]);
+    }
+    return code;
+}
+
+void Cpu::CacheDecodedProgram(const Program &program, DecodedProgram image)
+{
+    FuseSuperinstructions(image);
+    image.pages = program.codeSegment.memory.usedPages;
+    image.pageVersions.clear();
+    for(int page : image.pages)
+    {
+        image.pageVersions.push_back(pageTable[page].version);
+    }
+    decodedPrograms[image.pages[0]] = std::move(image);
+}
+
+bool Cpu::IsDecodedProgramValid(const DecodedProgram &image, const Program &program)
+{
+    if(image.pages != program.codeSegment.memory.usedPages)
+        return false;
+
+    for(int i = 0; i < (int)image.pages.size(); i++)
+    {
+        if(pageTable[image.pages[i]].version != image.pageVersions[i])
+            return false;
+    }
+    return true;
+}
+
+// The image of the last launch of name with keyword, if its code pages are in RAM, unchanged since
+// they were decoded and the drive has not been written since they were read from it
+const DecodedProgram *Cpu::FindLoadedProgram(const std::string &name, int keyword)
+{
+    auto loaded = loadedPrograms.find({name, keyword});
+    if(loaded == loadedPrograms.end())
+        return nullptr;
+    auto entry = decodedPrograms.find(loaded->second);
+    if(entry == decodedPrograms.end())
+        return nullptr;
+
+    const DecodedProgram &image = entry->second;
+    if(image.name != name || image.driveGeneration != driveGeneration)
+        return nullptr;
+    for(int i = 0; i < (int)image.pages.size(); i++)
+    {
+        const Page &page = pageTable[image.pages[i]];
+        if(!page.used || page.onDisk || page.frame == -1 || page.version != image.pageVersions[i])
+            return nullptr;
+    }
+    return &image;
+}
+
+// Returns the decoded image of the program, decoding it again from RAM if
+// one of the code pages was swapped or rewritten since the last decode
+DecodedProgram *Cpu::GetDecodedProgram(const Program &program)
+{
+    int key = program.codeSegment.memory.usedPages[0];
+    auto image = decodedPrograms.find(key);
+    if(image != decodedPrograms.end() && IsDecodedProgramValid(image->second, program))
+        return &image->second;
+
+    DecodedProgram fresh = DecodeProgram(ReadCodeSegment(program));
+    if(image != decodedPrograms.end())
+    {
+        fresh.name = image->second.name;
+        fresh.pairCounts = std::move(image->second.pairCounts);
+    }
+    CacheDecodedProgram(program, std::move(fresh));
+    return &decodedPrograms[key];
+}
+
+// Runs of instructions the loader fuses unless a profile never saw them
+struct FusedSequence
+{
+    int fused;
+    std::vector<int> opcodes;
+};
+
+static const std::vector<FusedSequence> fusedSequences = {
+    {FUSED_COMPARE_BRANCH, {LOADI, CMPR, JZ}},
+    {FUSED_COMPARE_BRANCH, {LOADI, CMPR, JNZ}},
+    {FUSED_VALUE_INTERRUPT, {STR, STORER, INT}},
+    {FUSED_VALUE_INTERRUPT, {LOADV, STORER, INT}},
+};
+
+static bool CanStartFusion(const DecodedInstruction &instruction)
+{
+    switch(instruction.opcode)
+    {
+    case(STOP): case(INT): case(PUSH): case(POP): case(MOD): case(CALL): case(RET):
+    case(JZ): case(JNZ): case(JL): case(JLE): case(JG): case(JGE): case(JMP):
+    case(JO): case(JP): case(JC):
+        return false;
+    default:
+        return instruction.opcode > STOP && instruction.opcode <= STRCAT;
+    }
+}
+
+// The last instruction of a run may jump or interrupt, but nothing in a run
+// may stop the machine or wait for input. An instruction that faults is
+// restarted on its own, the ones before it in the run stay retired
+static bool CanEndFusion(const DecodedInstruction &instruction)
+{
+    switch(instruction.opcode)
+    {
+    case(STOP): case(PUSH): case(POP): case(MOD):
+        return false;
+    case(INT):
+        return instruction.operand != 5;
+    default:
+        return instruction.opcode > STOP && instruction.opcode <= STRCAT;
+    }
+}
+
+static std::map<std::pair<int, int>, long long> ReadProfile(const std::string &name)
+{
+    std::map<std::pair<int, int>, long long> profile;
+    std::ifstream file(name + ".profile");
+    int first, second;
+    long long count;
+    while(file >> first >> second >> count)
+    {
+        profile[{first, second}] += count;
+    }
+    return profile;
+}
+
+void Cpu::FuseSuperinstructions(DecodedProgram &image)
+{
+    std::map<std::pair<int, int>, long long> profile;
+    if(image.name.size() > 0)
+        profile = ReadProfile(image.name);
+
+    auto pairCount = [&](int first, int second)
+    {
+        auto pair = profile.find({first, second});
+        return pair != profile.end() ? pair->second : 0;
+    };
+
+    std::vector<DecodedInstruction> &instructions = image.instructions;
+    int count = instructions.size();
+    for(int pc = 0; pc < count; pc++)
+    {
+        DecodedInstruction &first = instructions[pc];
+        first.fused = FUSED_NONE;
+        first.fusedLength = 0;
+        if(!CanStartFusion(first) || first.nextPc >= count)
+            continue;
+
+        for(const FusedSequence &fusedSequence : fusedSequences)
+        {
+            const std::vector<int> &sequence = fusedSequence.opcodes;
+            int length = sequence.size();
+            int at = pc;
+            bool matches = true;
+            for(int i = 0; i < length && matches; i++)
+            {
+                matches = at < count && instructions[at].opcode == sequence[i];
+                if(matches && i > 0 && profile.size() > 0)
+                    matches = pairCount(sequence[i-1], sequence[i]) > 0;
+                if(matches && i > 0 && i < length-1)
+                    matches = CanStartFusion(instructions[at]);
+                if(matches && i == length-1)
+                    matches = CanEndFusion(instructions[at]);
+                if(matches)
+                    at = instructions[at].nextPc;
+            }
+            if(!matches)
+                continue;
+
+            // the handlers only know the x and c registers
+            char reg = instructions[first.nextPc].operand;
+            if(reg != 'x' && reg != 'c')
+                continue;
+            first.fused = fusedSequence.fused;
+            first.fusedLength = length;
+            break;
+        }
+    }
+}
+
+// Executes the superinstruction at current. The caller has counted its first
+// instruction, the rest are counted as they start so a fault part way through
+// leaves only the instructions before it retired
+void Cpu::ExecuteFused()
+{
+    const DecodedInstruction *middle = &decoded->instructions[current->nextPc];
+    const DecodedInstruction *last = &decoded->instructions[middle->nextPc];
+    int &reg = (char)middle->operand == 'x' ? xReg : cReg;
+
+    if(current->fused == FUSED_COMPARE_BRANCH)
+    {
+        acc = current->operand;
+        runExecuted++;
+        current = middle;
+        UpdateCompareFlags(reg);
+        MaterializeFlags();
+
+        runExecuted++;
+        current = last;
+        ir = last->opcode;
+        bool taken = (fs&zf) == 2;
+        if(ir == JNZ)
+        {
+            taken = !taken;
+            fs ^= zf;
+        }
+        pc = taken ? (uint8_t)last->operand : last->nextPc;
+        return;
+    }
+
+    if(ir == STR)
+        OP_STR();
+    else
+        OP_LOADV();
+    runExecuted++;
+    current = middle;
+    reg = acc;
+
+    runExecuted++;
+    current = last;
+    ir = INT;
+    OP_INT();
+}
+
+void Cpu::SaveProfiles()
+{
+    // Several loads of the same program share one profile
+    std::map<std::string, std::map<std::pair<int, int>, long long>> profiles;
+    for(auto &image : decodedPrograms)
+    {
+        if(image.second.name.size() == 0 || image.second.pairCounts.size() == 0)
+            continue;
+        for(auto &pair : image.second.pairCounts)
+        {
+            profiles[image.second.name][pair.first] += pair.second;
+        }
+        image.second.pairCounts.clear();
+    }
+
+    for(auto &profile : profiles)
+    {
+        auto merged = ReadProfile(profile.first);
+        for(auto &pair : profile.second)
+        {
+            merged[pair.first] += pair.second;
+        }
+
+        std::ofstream file(profile.first + ".profile");
+        for(auto &pair : merged)
+        {
+            file << pair.first.first << " " << pair.first.second << " " << pair.second << "\n";
+        }
+    }
+}
+
+Program &Cpu::ContextProgram(int id)
+{
+    if(id == -1)
+        return bootContext;
+    return processList[id].program;
+}
+
+// Parks the running context and resumes id where it left off. Only the
+// registers and the Program handles move, not the program itself.
+void Cpu::SwitchTo(int id)
+{
+    int current = memcontroller.activeProcessId;
+    if(id == current)
+        return;
+
+    long long retired = instructionsRetired + runExecuted;
+    activeProgram.cycles += retired - contextStart;
+    contextStart = retired;
+    activeProgram.cpuSnapshot = SaveToSnapshot();
+    ContextProgram(current) = std::move(activeProgram);
+
+    // translations cached for the old process would credit its pages with the new one's accesses
+    memcontroller.FlushTlb();
+    memcontroller.EndSlice();
+    memcontroller.activeProcessId = id;
+    activeProgram = std::move(ContextProgram(id));
+    SetFromSnapshot(activeProgram.cpuSnapshot);
+    retReg = activeProgram.cpuSnapshot.retReg;
+    faultedPages.clear();
+
+    // id was most likely next in line at the last switch, its pages were read from swap since
+    memcontroller.CompletePrefetch(id);
+    decoded = GetDecodedProgram(activeProgram);
+    if(scheduler.Peek() != NO_PROCESS)
+        memcontroller.Prefetch(scheduler.Peek());
+}
+
+void Cpu::Preempt()
+{
+    if(!scheduler.HasReady() || (fs & ef) != 0)
+        return;
+
+    scheduler.Add(memcontroller.activeProcessId);
+    try
+    {
+        SwitchTo(scheduler.Next());
+    }
+    catch(OutOfMemory *error)
+    {
+        // the code of the process switched to could not be swapped in
+        KillCurrentProcess(error);
+    }
+}
+
+// public functions
+
+void Cpu::ShowRam()
+{
+    printf("CODE: (starting from %d)\n", memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[0]));
+    printf("[");
+    for(int i = 0; i < 50; i++)
+    {
+        printf("%d, ", RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[i])]);
+    }
+    printf("]\n");
+
+    printf("STACK: (starting from %d)\n", memcontroller.ConvertToPhysAddress(activeProgram.stackSegment.memory.addresses[activeProgram.stackSegment.memory.addresses.size()-1]));
+    printf("[");
+    for(int i = activeProgram.stackSegment.memory.addresses.size(); 
+    i > activeProgram.stackSegment.memory.addresses.size() - 50; i--)
     {
         printf("%d, ", RAM[memcontroller.ConvertToPhysAddress(activeProgram.stackSegment.memory.addresses[i])]);
     }
@@ -1145,52 +1882,72 @@ void Cpu::ShowRam()
     printf("]\n");
 }
 
-Program Cpu::LoadProgram(std::vector<int> programCode)
+Program Cpu::LoadProgram(std::vector<int> programCode, std::string name)
 {
     // Machine code is loaded to the list, now we load this code into RAM
     Segment codeSegment;
     Segment stackSegment;
     Segment dataSegment;
 
-    codeSegment = memcontroller.InitSegment(0);
-    dataSegment = memcontroller.InitSegment(0);
-    stackSegment = memcontroller.InitSegment(1);
-    std::vector<int> pagesToIgnore;
-
-    for(int i = 0; i < programCode.size(); i++){
-        if(i >= codeSegment.memory.addresses.size())
+    try
+    {
+        codeSegment = memcontroller.InitSegment(0);
+        dataSegment = memcontroller.InitSegment(0);
+        stackSegment = memcontroller.InitSegment(1);
+        std::vector<int> pagesToIgnore;
+
+        for(int i = 0; i < programCode.size(); i++){
+            if(i >= codeSegment.memory.addresses.size())
+            {
+                pagesToIgnore.insert(pagesToIgnore.end(), dataSegment.memory.usedPages.begin(),
+                dataSegment.memory.usedPages.end());
+
+                pagesToIgnore.insert(pagesToIgnore.end(), codeSegment.memory.usedPages.begin(),
+                codeSegment.memory.usedPages.end());
+
+                pagesToIgnore.insert(pagesToIgnore.end(), stackSegment.memory.usedPages.begin(),
+                stackSegment.memory.usedPages.end());
+
+                Memory newmem = memcontroller.AllocateMemory(programCode.size() - codeSegment.memory.addresses.size(), pagesToIgnore);
+
+                codeSegment.memory.usedPages.insert(codeSegment.memory.usedPages.end(),
+                newmem.usedPages.begin(), newmem.usedPages.end());
+                
+                codeSegment.memory.addresses.Append(newmem.addresses);
+            }
+            memcontroller.WriteSegment(codeSegment, codeSegment.memory.addresses[i], programCode[i]);
+        }
+    }
+    catch(OutOfMemory *error)
+    {
+        // a program that does not fit gives back the segments it already got
+        for(Segment *segment : {&codeSegment, &dataSegment, &stackSegment})
         {
-            pagesToIgnore.insert(pagesToIgnore.end(), dataSegment.memory.usedPages.begin(),
-            dataSegment.memory.usedPages.end());
-
-            pagesToIgnore.insert(pagesToIgnore.end(), codeSegment.memory.usedPages.begin(),
-            codeSegment.memory.usedPages.end());
-
-            pagesToIgnore.insert(pagesToIgnore.end(), stackSegment.memory.usedPages.begin(),
-            stackSegment.memory.usedPages.end());
-
-            Memory newmem = memcontroller.AllocateMemory(programCode.size() - codeSegment.memory.addresses.size(), pagesToIgnore);
-
-            codeSegment.memory.usedPages.insert(codeSegment.memory.usedPages.end(),
-            newmem.usedPages.begin(), newmem.usedPages.end());
-            
-            codeSegment.memory.addresses.insert(codeSegment.memory.addresses.end(),
-            newmem.addresses.begin(), newmem.addresses.end());
+            memcontroller.FreeMemory(segment->memory);
         }
-        memcontroller.WriteSegment(codeSegment, codeSegment.memory.addresses[i], programCode[i]);
+        throw;
     }
 
     int newSP = stackSegment.startPointer + PAGE_SIZE-1;
     //pc = 0;
 
-    return {dataSegment, codeSegment, stackSegment, {0, 0, 0, 0, newSP, 0, 0}};
+    Program program = {dataSegment, codeSegment, stackSegment, {0, 0, 0, 0, newSP, 0, 0}};
+
+    // Pages are cleared before use, so the rest of the segment decodes as zeroes
+    programCode.resize(codeSegment.memory.addresses.size(), 0);
+    DecodedProgram image = DecodeProgram(programCode);
+    image.name = name;
+    CacheDecodedProgram(program, std::move(image));
+
+    return program;
 }
 
 Program Cpu::LoadBootloader()
 {
     auto code = iocontroller.FindProgramCode("bootl", 1453);
-    Program program = LoadProgram(code);
+    Program program = LoadProgram(code, "bootloader");
     activeProgram = program;
+    decoded = GetDecodedProgram(activeProgram);
     return activeProgram;
 }
 
@@ -1248,8 +2005,7 @@ Program Cpu::LoadProgram(std::string filename)
             codeSegment.memory.usedPages.insert(codeSegment.memory.usedPages.end(),
             newmem.usedPages.begin(), newmem.usedPages.end());
             
-            codeSegment.memory.addresses.insert(codeSegment.memory.addresses.end(),
-            newmem.addresses.begin(), newmem.addresses.end());
+            codeSegment.memory.addresses.Append(newmem.addresses);
         }
         memcontroller.WriteSegment(codeSegment, codeSegment.memory.addresses[i], machineCode[i]);
     }
@@ -1259,35 +2015,132 @@ Program Cpu::LoadProgram(std::string filename)
 
     activeProgram = {dataSegment, codeSegment, stackSegment, {pc, 0, 0, 0, sp, 0, 0}};
 
+    machineCode.resize(codeSegment.memory.addresses.size(), 0);
+    DecodedProgram image = DecodeProgram(machineCode);
+    image.name = filename;
+    CacheDecodedProgram(activeProgram, std::move(image));
+    decoded = GetDecodedProgram(activeProgram);
+
     return activeProgram;
 }
 
-Program Cpu::ExecuteProgram(Program program, int cycles)
+void Cpu::EnterProgram(Program program)
 {
-    int c = 0;
     SetFromSnapshot(program.cpuSnapshot);
-    activeProgram = memcontroller.PrepareProgramMemory(program);
+    activeProgram = std::move(program);
+    faultedPages.clear();
     sp = activeProgram.stackSegment.memory.addresses[activeProgram.stackSegment.memory.addresses.size()-1];
-    
-    while(c < cycles && (fs & ef) == 0)
+    decoded = GetDecodedProgram(activeProgram);
+    contextStart = instructionsRetired;
+}
+
+// Runs the active program until an event needs attention from outside the
+// interpreter or the budget runs out
+CpuEvent Cpu::Run(int budget, int *executed)
+{
+    // kept in a member so int 37 can count the instructions of this run too
+    runExecuted = 0;
+    int &c = runExecuted;
+    CpuEvent event;
+    try
+    {
+        if(profiling || GUEST_PROFILING)
+            event = RunSwitch(budget, c);
+        else if(engine == ENGINE_JIT)
+            event = RunJit(budget, c);
+        else if(engine == ENGINE_THREADED)
+            event = RunThreaded(budget, c);
+        else
+            event = RunSwitch(budget, c);
+    }
+    catch(PageFault *fault)
+    {
+        // Faulting instructions do not change any state before translating,
+        // so the instruction is restarted once the page is back in memory
+        pc = current - decoded->instructions.data();
+        c--;
+        if(c > 0)
+            faultedPages.clear();
+        faultedPages.push_back(fault->page);
+        delete fault;
+        event = EVENT_FAULT;
+    }
+    catch(OutOfMemory *error)
+    {
+        KillCurrentProcess(error);
+        event = (fs & ef) != 0 ? EVENT_HALT : EVENT_STOP;
+    }
+
+    // Instructions no longer go through ConvertToPhysAddress, so credit the code
+    // pages in bulk to keep them from looking idle to the page replacement
+    for(int page : decoded->pages)
+    {
+        memcontroller.CountAccesses(page, c);
+    }
+    instructionsRetired += c;
+    if(executed != nullptr)
+        *executed = c;
+    runExecuted = 0;
+    return event;
+}
+
+void Cpu::ServiceEvent(CpuEvent event)
+{
+    try
     {
-        try
+        if(event == EVENT_FAULT)
         {
+            // an instruction spanning several pages must not push out the ones it already faulted in
+            memcontroller.SwapIn(faultedPages.back(), faultedPages);
+            decoded = GetDecodedProgram(activeProgram);
+        }
+        else if(event == EVENT_BLOCK)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if(blockingEvents++ == 0)
+                firstBlock = start;
             Fetch();
             Decode();
+            instructionsRetired++;
+            blockedTime += std::chrono::steady_clock::now() - start;
         }
-        catch(std::runtime_error &error)
+    }
+    catch(OutOfMemory *error)
+    {
+        KillCurrentProcess(error);
+    }
+}
+
+Program Cpu::ExecuteProgram(Program program, int cycles)
+{
+    int c = 0;
+    EnterProgram(program);
+
+    while(c < cycles && (fs & ef) == 0)
+    {
+        int executed = 0;
+        CpuEvent event = Run(cycles - c, &executed);
+        c += executed;
+        if(event == EVENT_BLOCK)
         {
-            throw error;
+            ServiceEvent(event);
+            c++;
+        }
+        else if(event == EVENT_FAULT)
+        {
+            ServiceEvent(event);
         }
-        c++;
     }
+
+    activeProgram.cycles += instructionsRetired - contextStart;
+    contextStart = instructionsRetired;
     activeProgram.cpuSnapshot = SaveToSnapshot();
-    if(!((fs & ef) == 0))
+    // Processes free their pages in EndCurrentProcess. A program run on its own keeps its
+    // addresses in the returned copy, so callers can still read what it left in RAM
+    if((fs & ef) != 0 && memcontroller.activeProcessId == -1)
     {
-        //memcontroller.FreeMemory(activeProgram.codeSegment.memory);
-        //memcontroller.FreeMemory(activeProgram.stackSegment.memory);
-        //memcontroller.FreeMemory(activeProgram.dataSegment.memory);
+        Program finished = activeProgram;
+        memcontroller.FreeProgram(finished);
     }
 
     return activeProgram;
@@ -1295,6 +2148,7 @@ Program Cpu::ExecuteProgram(Program program, int cycles)
 
 CpuSnapshot Cpu::SaveToSnapshot()
 {
+    MaterializeFlags();
     CpuSnapshot snap;
     snap.acc = acc;
     snap.addr = addr;
@@ -1314,6 +2168,7 @@ void Cpu::SetFromSnapshot(CpuSnapshot snapshot)
     addr = snapshot.addr;
     cReg = snapshot.cReg;
     fs = snapshot.fs;
+    flagKind = FLAGS_NONE;
     sp = snapshot.sp;
     ir = snapshot.ir;
     pc = snapshot.pc;
@@ -1334,47 +2189,64 @@ int Cpu::MulInternal(int x, int y)
     return x * y;
 }
 
-bool Cpu::ParityCheck()
+// Flags a pending result of the given kind can set
+static inline int PendingFlagBits(int kind)
+{
+    if(kind == FLAGS_RESULT)
+        return sf | zf | pf;
+    if(kind == FLAGS_COMPARE)
+        return lf | zf | pf;
+    return 0;
+}
+
+// Records the accumulator for the sign, zero and parity flags. Flags are sticky,
+// so a result is only kept, and the one before it only folded, while it could
+// still set a bit fs does not have yet
+void Cpu::UpdateFlags()
 {
-    bool parity = 0; 
-    int n = acc;
-    while (n) 
-    { 
-        parity = !parity; 
-        n     = n & (n - 1); 
-    }      
-    return parity; 
+    if((fs & PendingFlagBits(flagKind)) != PendingFlagBits(flagKind))
+        MaterializeFlags();
+    flagKind = (fs & PendingFlagBits(FLAGS_RESULT)) == PendingFlagBits(FLAGS_RESULT) ? FLAGS_NONE : FLAGS_RESULT;
+    flagResult = acc;
+}
+
+// Records a comparison of the accumulator with val for the lower, zero and parity flags
+void Cpu::UpdateCompareFlags(uint16_t val)
+{
+    if((fs & PendingFlagBits(flagKind)) != PendingFlagBits(flagKind))
+        MaterializeFlags();
+    flagKind = (fs & PendingFlagBits(FLAGS_COMPARE)) == PendingFlagBits(FLAGS_COMPARE) ? FLAGS_NONE : FLAGS_COMPARE;
+    flagResult = acc;
+    flagOperand = val;
+}
+
+void Cpu::MaterializeFlags()
+{
+    if(flagKind == FLAGS_NONE)
+        return;
+
+    // inlined without popcnt, which only the JIT uses after checking the host has it
+    int parity = __builtin_parity(flagResult) ? pf : 0;
+    if(flagKind == FLAGS_RESULT)
+        fs |= (flagResult < 0 ? sf : 0) | (flagResult == 0 ? zf : 0) | parity;
+    else
+        fs |= (flagResult < flagOperand ? lf : 0) | (flagResult == flagOperand ? zf : 0) | parity;
+    flagKind = FLAGS_NONE;
 }
 
 // Interrupts
 void Cpu::int10()
 {
-    HeapBlockHandler handle;
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == xReg)
-        {
-            handle = i;
-            xReg = 0;
-            break;
-        }
-    }
+    HeapBlockHandler handle = memcontroller.FindHeapBlock(xReg);
+    if(handle.size != -1)
+        xReg = 0;
     std::string str = memcontroller.ReadStringFromHeap(handle);
     printf("%s\n", str.c_str());
 }
 
 void Cpu::int3()
 {
-    HeapBlockHandler handle;
-    handle.size = -1;
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == cReg)
-        {
-            handle = i;
-            break;
-        }
-    }
+    HeapBlockHandler handle = memcontroller.FindHeapBlock(cReg);
     if(handle.size == -1)
     {
         //TODO: kill parent process with error
@@ -1403,7 +2275,7 @@ void Cpu::int3()
         }
         code = iocontroller.FindProgramCode(newTok[0], keyword);
     }
-    else{
+    else if(tokens.size() == 1){
         code = iocontroller.FindProgramCode(tokens[0], keyword);
     }
 
@@ -1414,37 +2286,96 @@ void Cpu::int3()
     }
     else
     {
-        auto program = LoadProgram(code); 
-        
-        acc = memcontroller.ForkProcess(tokens, program);
+        // heap strings keep their terminator, the name ends at it
+        std::string name = tokens[0].substr(0, tokens[0].find('\0'));
+        int processId = -1;
+
+        // A copy that is already in memory is shared copy-on-write instead of loading it again
+        const DecodedProgram *loaded = FindLoadedProgram(name, keyword);
+        if(loaded != nullptr)
+        {
+            DecodedProgram image = *loaded;
+            Program source;
+            source.codeSegment.memory = {image.pages, AddressList(image.pages)};
+            processId = memcontroller.ForkProcess(tokens, source, true);
+            if(processId != -1)
+            {
+                const Program &program = processList[processId].program;
+                image.pages = program.codeSegment.memory.usedPages;
+                image.pageVersions.clear();
+                for(int page : image.pages)
+                {
+                    image.pageVersions.push_back(pageTable[page].version);
+                }
+                image.pairCounts.clear();
+                image.previousOpcode = -1;
+                decodedPrograms[image.pages[0]] = std::move(image);
+            }
+        }
+        if(processId == -1)
+        {
+            try
+            {
+                processId = memcontroller.ForkProcess(tokens, LoadProgram(code, name));
+            }
+            catch(OutOfMemory *error)
+            {
+                // the parent carries on and sees the fork fail like for an unknown program
+                std::cout << error->what() << std::endl;
+                delete error;
+                cReg = -1;
+                return;
+            }
+        }
+
+        // the next launch shares this copy until the drive is written
+        Program &program = processList[processId].program;
+        auto image = decodedPrograms.find(program.codeSegment.memory.usedPages[0]);
+        if(image != decodedPrograms.end())
+        {
+            image->second.driveGeneration = driveGeneration;
+            loadedPrograms[{name, keyword}] = image->first;
+        }
+
+        // processes start with the stack pointer on top of their stack segment
+        program.cpuSnapshot.sp = program.stackSegment.memory.addresses[program.stackSegment.memory.addresses.size()-1];
+        acc = processId;
+        scheduler.Add(acc);
 
         cReg = 0;
     }
 }
 
+// Waits for the process in x to exit, whatever is ready runs in the meantime
 void Cpu::int4()
 {
     int processId = xReg;
-    pc++;
-    auto snap = SaveToSnapshot();
-    processList[memcontroller.activeProcessId].program.cpuSnapshot = snap;
-    memcontroller.activeProcessId = processId;
-    activeProgram = processList[memcontroller.activeProcessId].program;
-    
-    ExecuteProgram(activeProgram);
+    if(processId < 0 || processId >= (int)processList.size() || processId == memcontroller.activeProcessId)
+        return;
+    if(processList[processId].status != 1)
+        return;
+
+    scheduler.Wait(memcontroller.activeProcessId, processId);
+    int next = scheduler.Next();
+    if(next == NO_PROCESS)
+    {
+        fs |= ef;
+        return;
+    }
+    SwitchTo(next);
 }
 
 void Cpu::int5()
 {
-    char c = getchar();
+    int c = getchar();
     std::string s;
-    while(c != '\n')
+    while(c != '\n' && c != EOF)
     {
         s.push_back(c);
         c = getchar();
     }
 
-    auto memBlock = memcontroller.HeapAlloc(activeProgram, s.size());
+    auto memBlock = memcontroller.HeapAlloc(memcontroller.activeProcessId, s.size());
     memcontroller.StoreStringInHeap(memBlock, s);
     acc = memBlock.start;
 }
@@ -1452,7 +2383,7 @@ void Cpu::int5()
 void Cpu::int30()
 {
     std::string str = filesystem.getFileDescriptorString(acc);
-    auto memBlock = memcontroller.HeapAlloc(activeProgram, str.size());
+    auto memBlock = memcontroller.HeapAlloc(memcontroller.activeProcessId, str.size());
     memcontroller.StoreStringInHeap(memBlock, str);
     acc = memBlock.start;
 }
@@ -1460,7 +2391,7 @@ void Cpu::int30()
 void Cpu::int33()
 {
     std::string str = memcontroller.getProcessInfoString(acc);
-    auto memBlock = memcontroller.HeapAlloc(activeProgram, str.size());
+    auto memBlock = memcontroller.HeapAlloc(memcontroller.activeProcessId, str.size());
     memcontroller.StoreStringInHeap(memBlock, str);
     acc = memBlock.start;
 }
@@ -1478,32 +2409,18 @@ void Cpu::int32()
 
 void Cpu::int15()
 {
-    HeapBlockHandler handle;
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == xReg)
-        {
-            handle = i;
-            xReg = 0;
-            break;
-        }
-    }
+    HeapBlockHandler handle = memcontroller.FindHeapBlock(xReg);
+    if(handle.size != -1)
+        xReg = 0;
     std::string filename = memcontroller.ReadStringFromHeap(handle);
     int fdIndex = filesystem.generateNewDescriptor(filename);
     acc = fdIndex;
 }
 
 void Cpu::int16(){
-    HeapBlockHandler handle;
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == xReg)
-        {
-            handle = i;
-            xReg = 0;
-            break;
-        }
-    }
+    HeapBlockHandler handle = memcontroller.FindHeapBlock(xReg);
+    if(handle.size != -1)
+        xReg = 0;
     std::string filename = memcontroller.ReadStringFromHeap(handle);
     bool result = filesystem.deleteFile(filename);
 
@@ -1514,28 +2431,15 @@ void Cpu::int16(){
 }
 
 void Cpu::int17(){
-    HeapBlockHandler handle;
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == xReg)
-        {
-            handle = i;
-            xReg = 0;
-            break;
-        }
-    }
+    HeapBlockHandler handle = memcontroller.FindHeapBlock(xReg);
+    if(handle.size != -1)
+        xReg = 0;
     std::string filename = memcontroller.ReadStringFromHeap(handle);
 
 
-    for(auto i : HeapBlockHandlers)
-    {
-        if(i.start == cReg)
-        {
-            handle = i;
-            cReg = 0;
-            break;
-        }
-    }
+    handle = memcontroller.FindHeapBlock(cReg);
+    if(handle.size != -1)
+        cReg = 0;
     std::string newFilename = memcontroller.ReadStringFromHeap(handle);
     
     bool result = filesystem.modifyFile(filename, newFilename);
@@ -1549,14 +2453,17 @@ void Cpu::int17(){
 void Cpu::int18(){}
 
 void Cpu::int35(){
-    acc = processList[memcontroller.activeProcessId].args.size();
+    if(memcontroller.activeProcessId == -1)
+        acc = 0;
+    else
+        acc = processList[memcontroller.activeProcessId].args.size();
 }
 
 void Cpu::int36(){
-    if(acc < processList[memcontroller.activeProcessId].args.size())
+    if(memcontroller.activeProcessId != -1 && acc < processList[memcontroller.activeProcessId].args.size())
     {
         std::string str = processList[memcontroller.activeProcessId].args[acc];
-        auto memBlock = memcontroller.HeapAlloc(activeProgram, str.size());
+        auto memBlock = memcontroller.HeapAlloc(memcontroller.activeProcessId, str.size());
 
         memcontroller.StoreStringInHeap(memBlock, str);
         xReg = memBlock.start;
@@ -1566,33 +2473,39 @@ void Cpu::int36(){
     }
 }
 
-std::string Cpu::buildString()
+long long Cpu::ReadCounter(int counter)
 {
-    std::vector<char> contents;
-    char c = -1;
-    pc++;
-    while(c != 0)
+    long long retired = instructionsRetired + runExecuted;
+    switch(counter)
     {
-        c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc])];
-        if(c == '\\')
-        {
-            c = RAM[memcontroller.ConvertToPhysAddress(activeProgram.codeSegment.memory.addresses[pc+1])];
-            if(c == 'n')
-            contents.insert(contents.end(), '\n');
-            pc+=2;
-        }
-        else if (c == '_')
-        {
-            c = ' ';
-            contents.insert(contents.end(), c);
-            pc++;
-        }
-        else
-        {
-            contents.insert(contents.end(), c);
-            pc++;
-        }
+        case COUNTER_INSTRUCTIONS:
+            return retired;
+        case COUNTER_PROCESS_CYCLES:
+            return activeProgram.cycles + retired - contextStart;
+        case COUNTER_PAGE_FAULTS:
+            return memcontroller.pageFaults;
+        case COUNTER_SWAP_INS:
+            return memcontroller.swapIns;
+        case COUNTER_SWAP_OUTS:
+            return memcontroller.swapOuts;
+        case COUNTER_HEAP_BYTES:
+            return memcontroller.heapBytesAllocated;
+        case COUNTER_PAGE_HITS:
+            return memcontroller.pageHits;
+        default:
+            return -1;
     }
-    std::string str(contents.begin(), contents.end());
-    return str;
-}
\ No newline at end of file
+}
+
+// Counters wrap around like hardware ones, guests time themselves by differences
+void Cpu::int37()
+{
+    long long value = ReadCounter(acc);
+    acc = value < 0 ? -1 : value & std::numeric_limits<int>::max();
+}
+
+std::string Cpu::buildString()
+{
+    pc = current->nextPc;
+    return decoded->strings[current->operand];
+}
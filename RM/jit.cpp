@@ -0,0 +1,620 @@
+#include "jit.h"
+#include "cpu.h"
+#include <string.h>
+#include <stdlib.h>
+
+#if JIT_SUPPORTED
+#include <sys/mman.h>
+
+// Host register assignment inside compiled blocks
+enum
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RSI = 6,  // RAM base
+    RDI = 7,  // JitFrame
+    R8 = 8,   // acc
+    R9 = 9,   // fs
+    R10 = 10, // budget
+    R11 = 11  // retReg
+};
+
+#define FRAME(field) ((uint8_t)offsetof(JitFrame, field))
+
+// Worst case bytes for one guest instruction plus the exit stubs it may need
+#define JIT_MAX_INSTRUCTION_BYTES 96
+
+namespace
+{
+    class Emitter
+    {
+        public:
+            uint8_t *code;
+
+            Emitter(uint8_t *code) : code(code) {}
+
+            void Byte(uint8_t b) { *code++ = b; }
+            void Int(int v) { memcpy(code, &v, 4); code += 4; }
+            void Rex(bool w, int reg, int rm)
+            {
+                uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+                if(rex != 0x40)
+                    Byte(rex);
+            }
+            void ModRM(int mod, int reg, int rm) { Byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+
+            // op reg, reg (opcode is the "rm, reg" form)
+            void RegReg(uint8_t opcode, int rm, int reg, bool wide = false)
+            {
+                Rex(wide, reg, rm);
+                Byte(opcode);
+                ModRM(3, reg, rm);
+            }
+            // op reg, [base + disp8] or op [base + disp8], reg
+            void RegFrame(uint8_t opcode, int reg, uint8_t disp, bool wide = false)
+            {
+                Rex(wide, reg, RDI);
+                Byte(opcode);
+                ModRM(1, reg, RDI);
+                Byte(disp);
+            }
+            // op reg, [rsi + disp32], the RAM cell at a fixed physical address
+            void RegRam(uint8_t opcode, int reg, int address)
+            {
+                Rex(false, reg, RSI);
+                Byte(opcode);
+                ModRM(2, reg, RSI);
+                Int(address * 4);
+            }
+            // group 1 op (add /0, or /1, and /4, sub /5, xor /6, cmp /7) reg, imm32
+            void RegImm(int group, int reg, int imm, bool wide = false)
+            {
+                Rex(wide, 0, reg);
+                Byte(0x81);
+                ModRM(3, group, reg);
+                Int(imm);
+            }
+            void MovImm(int reg, int imm)
+            {
+                Rex(false, 0, reg);
+                Byte(0xB8 + (reg & 7));
+                Int(imm);
+            }
+            void StoreFrameImm(uint8_t disp, int imm)
+            {
+                Byte(0xC7);
+                ModRM(1, 0, RDI);
+                Byte(disp);
+                Int(imm);
+            }
+            // jmp/jcc rel32, returns the rel32 site for linking
+            uint8_t *Jump()
+            {
+                Byte(0xE9);
+                Int(0);
+                return code - 4;
+            }
+            uint8_t *JumpIf(uint8_t condition)
+            {
+                Byte(0x0F);
+                Byte(0x80 | condition);
+                Int(0);
+                return code - 4;
+            }
+
+            // fs |= sf, zf, pf from acc
+            void UpdateFlags()
+            {
+                RegReg(0x85, R8, R8);                       // test r8d, r8d
+                Byte(0x0F); Byte(0x98); ModRM(3, 0, RAX);   // sets al
+                Byte(0x0F); Byte(0x94); ModRM(3, 0, RCX);   // sete cl
+                Byte(0x0F); Byte(0xB6); ModRM(3, RAX, RAX); // movzx eax, al
+                Byte(0x0F); Byte(0xB6); ModRM(3, RCX, RCX); // movzx ecx, cl
+                Byte(0x8D); Byte(0x04); Byte(0x48);         // lea eax, [rax + rcx*2]
+                RegReg(0x09, R9, RAX);                      // or r9d, eax
+                Parity();
+            }
+            // fs |= lf, zf, pf after cmp acc, val
+            void UpdateCompareFlags()
+            {
+                Byte(0x0F); Byte(0x9C); ModRM(3, 0, RAX);   // setl al
+                Byte(0x0F); Byte(0x94); ModRM(3, 0, RCX);   // sete cl
+                Byte(0x0F); Byte(0xB6); ModRM(3, RAX, RAX); // movzx eax, al
+                Byte(0x0F); Byte(0xB6); ModRM(3, RCX, RCX); // movzx ecx, cl
+                Byte(0x8D); Byte(0x04); Byte(0x41);         // lea eax, [rcx + rax*2]
+                RegReg(0x01, RAX, RAX);                     // add eax, eax
+                RegReg(0x09, R9, RAX);                      // or r9d, eax
+                Parity();
+            }
+            // odd number of set bits in acc, same as Cpu::MaterializeFlags
+            void Parity()
+            {
+                Byte(0xF3); Rex(false, RAX, R8); Byte(0x0F); Byte(0xB8); ModRM(3, RAX, R8); // popcnt eax, r8d
+                Byte(0x83); ModRM(3, 4, RAX); Byte(1);      // and eax, 1
+                Byte(0xC1); ModRM(3, 4, RAX); Byte(6);      // shl eax, 6
+                RegReg(0x09, R9, RAX);                      // or r9d, eax
+            }
+    };
+
+    void Link(uint8_t *site, const void *target)
+    {
+        int offset = (const uint8_t*)target - (site + 4);
+        memcpy(site, &offset, 4);
+    }
+
+    bool IsMemoryOperand(int address)
+    {
+        return address >= 0 && address < RAM_SIZE;
+    }
+
+    bool IsRegisterOperand(int operand)
+    {
+        return (char)operand == 'x' || (char)operand == 'c';
+    }
+
+    uint8_t RegisterField(int operand)
+    {
+        return (char)operand == 'x' ? FRAME(xReg) : FRAME(cReg);
+    }
+
+    bool IsSupported(const DecodedInstruction &instruction)
+    {
+        switch(instruction.opcode)
+        {
+        case(LOADA): case(STOREA): case(ADDA): case(SUBA): case(MULA):
+        case(ANDA): case(ORA): case(XORA): case(CMPA):
+            return IsMemoryOperand(instruction.operand);
+        case(CMPR):
+            return IsRegisterOperand(instruction.operand);
+        case(LOADI): case(LOADR): case(STORER): case(ADDI): case(ADDR):
+        case(SUBI): case(SUBR): case(MULI): case(MULR): case(ANDI):
+        case(ANDR): case(ORI): case(ORR): case(XORI): case(XORR):
+        case(CMPI): case(INC): case(DEC): case(SHL): case(SHR):
+        case(JZ): case(JNZ): case(JL): case(JLE): case(JG): case(JGE):
+        case(JMP): case(JO): case(JP): case(JC): case(CALL): case(RET):
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool IsBranch(int opcode)
+    {
+        switch(opcode)
+        {
+        case(JZ): case(JNZ): case(JL): case(JLE): case(JGE):
+        case(JMP): case(JO): case(JP): case(JC): case(CALL): case(RET):
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    int BranchTarget(const DecodedInstruction &instruction)
+    {
+        if(instruction.opcode == CALL)
+            return (uint16_t)instruction.operand;
+        return (uint8_t)instruction.operand;
+    }
+}
+
+bool Jit::Available()
+{
+    if(!initialised)
+        Init();
+    return available;
+}
+
+void Jit::Init()
+{
+    initialised = true;
+    if(!__builtin_cpu_supports("popcnt"))
+        return;
+
+    void *memory = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+        return;
+    buffer = (uint8_t*)memory;
+
+    Emitter e(buffer);
+
+    // Shared exit: write the host registers back into the frame
+    epilogue = e.code;
+    e.RegFrame(0x89, R8, FRAME(acc));
+    e.RegFrame(0x89, R9, FRAME(fs));
+    e.RegFrame(0x89, R10, FRAME(budget), true);
+    e.RegFrame(0x89, R11, FRAME(retReg));
+    e.Byte(0xC3);
+
+    // void trampoline(JitFrame *frame, const void *block)
+    trampoline = (void (*)(JitFrame*, const void*))e.code;
+    e.RegReg(0x89, RAX, RSI, true);
+    e.RegFrame(0x8B, RSI, FRAME(ram), true);
+    e.RegFrame(0x8B, R8, FRAME(acc));
+    e.RegFrame(0x8B, R9, FRAME(fs));
+    e.RegFrame(0x8B, R10, FRAME(budget), true);
+    e.RegFrame(0x8B, R11, FRAME(retReg));
+    e.Byte(0xFF); e.ModRM(3, 4, RAX); // jmp rax
+
+    blocksStart = e.code - buffer;
+    used = blocksStart;
+    if(!Protect(PROT_READ | PROT_EXEC))
+    {
+        munmap(buffer, JIT_BUFFER_SIZE);
+        buffer = nullptr;
+        return;
+    }
+    available = true;
+}
+
+bool Jit::Protect(int protection)
+{
+    return mprotect(buffer, JIT_BUFFER_SIZE, protection) == 0;
+}
+
+void Jit::Flush()
+{
+    generation++;
+    used = blocksStart;
+}
+
+void Jit::Enter(JitFrame *frame, const void *block)
+{
+    trampoline(frame, block);
+}
+
+void Jit::Reset(JitImage &image, const std::vector<DecodedInstruction> &instructions)
+{
+    int count = instructions.size();
+    image.generation = generation;
+    image.entries.assign(count, nullptr);
+    image.blockLengths.assign(count, 0);
+    image.heat.assign(count, 0);
+    image.leaders.assign(count, false);
+    image.pendingLinks.clear();
+
+    // Walk the program the way it is laid out from pc 0 to find the block boundaries,
+    // the interpreter also starts a block after every instruction that is not compiled
+    if(count > 0)
+        image.leaders[0] = true;
+    for(int pc = 0; pc < count; pc = instructions[pc].nextPc)
+    {
+        const DecodedInstruction &instruction = instructions[pc];
+        if(!IsSupported(instruction) && instruction.nextPc < count)
+            image.leaders[instruction.nextPc] = true;
+        if(!IsBranch(instruction.opcode))
+            continue;
+        if(instruction.opcode != RET && BranchTarget(instruction) < count)
+            image.leaders[BranchTarget(instruction)] = true;
+        if(instruction.nextPc < count)
+            image.leaders[instruction.nextPc] = true;
+    }
+}
+
+void Jit::Prepare(JitImage &image, const std::vector<DecodedInstruction> &instructions)
+{
+    if(image.generation != generation || image.entries.size() != instructions.size())
+        Reset(image, instructions);
+}
+
+const void *Jit::Compile(JitImage &image, const std::vector<DecodedInstruction> &instructions, int start)
+{
+    if(!Available())
+        return nullptr;
+
+    // The buffer is never writable and executable at once, only while a block is emitted and linked
+    if(!Protect(PROT_READ | PROT_WRITE))
+    {
+        image.heat[start] = -1;
+        return nullptr;
+    }
+    const void *entry = Emit(image, instructions, start);
+    if(!Protect(PROT_READ | PROT_EXEC))
+        abort();
+    return entry;
+}
+
+const void *Jit::Emit(JitImage &image, const std::vector<DecodedInstruction> &instructions, int start)
+{
+    size_t worstCase = (JIT_MAX_BLOCK + 2) * JIT_MAX_INSTRUCTION_BYTES;
+    if(used + worstCase > JIT_BUFFER_SIZE)
+    {
+        Flush();
+        Reset(image, instructions);
+    }
+
+    int count = instructions.size();
+    uint8_t *entry = buffer + used;
+    Emitter e(entry);
+    std::vector<std::pair<uint8_t*, int>> exits; // rel32 sites and the guest pc they continue at
+
+    // Blocks run whole or not at all, so the budget is checked once on entry
+    e.RegImm(7, R10, 0, true);
+    uint8_t *lengthCheck = e.code - 4;
+    uint8_t *budgetExit = e.JumpIf(0xC); // jl
+    e.RegImm(5, R10, 0, true);
+    uint8_t *lengthSub = e.code - 4;
+
+    int pc = start;
+    int length = 0;
+    int lastOpcode = STOP;
+    int lastAddress = -1;
+    bool ended = false;
+
+    // addr and ir as the interpreter would leave them after the last instruction
+    auto commit = [&](int opcode)
+    {
+        if(lastAddress != -1)
+            e.StoreFrameImm(FRAME(addr), lastAddress);
+        e.StoreFrameImm(FRAME(ir), opcode);
+    };
+
+    while(length < JIT_MAX_BLOCK && pc < count)
+    {
+        const DecodedInstruction &instruction = instructions[pc];
+        if(!IsSupported(instruction))
+            break;
+        length++;
+        lastOpcode = instruction.opcode;
+
+        int operand = instruction.operand;
+        switch(instruction.opcode)
+        {
+        case(LOADA):
+            e.RegRam(0x8B, R8, operand);
+            break;
+        case(LOADI):
+            e.MovImm(R8, operand);
+            break;
+        case(LOADR):
+            if(IsRegisterOperand(operand))
+                e.RegFrame(0x8B, R8, RegisterField(operand));
+            break;
+        case(STOREA):
+            e.RegRam(0x89, R8, operand);
+            break;
+        case(STORER):
+            if(IsRegisterOperand(operand))
+                e.RegFrame(0x89, R8, RegisterField(operand));
+            break;
+        case(ADDA):
+            e.RegRam(0x03, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(ADDI):
+            e.RegImm(0, R8, operand-48);
+            e.UpdateFlags();
+            break;
+        case(SUBA):
+            e.RegRam(0x2B, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(SUBI):
+            // SUBI adds, like the interpreter does
+            e.RegImm(0, R8, operand-48);
+            e.UpdateFlags();
+            break;
+        case(ADDR):
+        case(SUBR):
+            if(IsRegisterOperand(operand))
+                e.RegFrame(instruction.opcode == ADDR ? 0x03 : 0x2B, R8, RegisterField(operand));
+            e.UpdateFlags();
+            break;
+        case(MULA):
+            e.Rex(false, R8, RSI); e.Byte(0x0F); e.Byte(0xAF); e.ModRM(2, R8, RSI); e.Int(operand * 4);
+            e.UpdateFlags();
+            break;
+        case(MULI):
+            e.Rex(false, R8, R8); e.Byte(0x69); e.ModRM(3, R8, R8); e.Int(operand-48);
+            e.UpdateFlags();
+            break;
+        case(MULR):
+            if(IsRegisterOperand(operand))
+            {
+                e.Rex(false, R8, RDI); e.Byte(0x0F); e.Byte(0xAF); e.ModRM(1, R8, RDI); e.Byte(RegisterField(operand));
+            }
+            e.UpdateFlags();
+            break;
+        case(ANDA):
+            e.RegRam(0x23, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(ORA):
+            e.RegRam(0x0B, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(XORA):
+            e.RegRam(0x33, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(ANDI):
+            e.RegImm(4, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(ORI):
+            e.RegImm(1, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(XORI):
+            e.RegImm(6, R8, operand);
+            e.UpdateFlags();
+            break;
+        case(ANDR):
+        case(ORR):
+        case(XORR):
+            // the register is the destination, acc stays as it was
+            if(IsRegisterOperand(operand))
+                e.RegFrame(instruction.opcode == ANDR ? 0x21 : instruction.opcode == ORR ? 0x09 : 0x31, R8, RegisterField(operand));
+            e.UpdateFlags();
+            break;
+        case(CMPA):
+            e.Byte(0x0F); e.Byte(0xB7); e.ModRM(2, RAX, RSI); e.Int(operand * 4); // movzx eax, word [ram]
+            e.RegReg(0x39, R8, RAX);
+            e.UpdateCompareFlags();
+            break;
+        case(CMPI):
+            e.RegImm(7, R8, (uint16_t)operand);
+            e.UpdateCompareFlags();
+            break;
+        case(CMPR):
+            e.Byte(0x0F); e.Byte(0xB7); e.ModRM(1, RAX, RDI); e.Byte(RegisterField(operand)); // movzx eax, word [reg]
+            e.RegReg(0x39, R8, RAX);
+            e.UpdateCompareFlags();
+            break;
+        case(INC):
+            e.Rex(false, 0, R8); e.Byte(0xFF); e.ModRM(3, 0, R8);
+            e.UpdateFlags();
+            break;
+        case(DEC):
+            e.Rex(false, 0, R8); e.Byte(0xFF); e.ModRM(3, 1, R8);
+            e.UpdateFlags();
+            break;
+        case(SHL):
+        case(SHR):
+        case(JG):
+            // no effect besides moving on, JG is never taken
+            break;
+        case(JZ):
+            commit(instruction.opcode);
+            e.Rex(false, 0, R9); e.Byte(0xF7); e.ModRM(3, 0, R9); e.Int(zf); // test r9d, zf
+            exits.push_back({e.JumpIf(0x5), BranchTarget(instruction)}); // jnz
+            exits.push_back({e.Jump(), instruction.nextPc});
+            ended = true;
+            break;
+        case(JNZ):
+            commit(instruction.opcode);
+            e.RegReg(0x89, RAX, R9);                          // mov eax, r9d
+            e.Rex(false, 0, R9); e.Byte(0x83); e.ModRM(3, 6, R9); e.Byte(zf); // xor r9d, zf
+            e.Byte(0xA9); e.Int(zf);                          // test eax, zf
+            exits.push_back({e.JumpIf(0x4), BranchTarget(instruction)}); // jz
+            exits.push_back({e.Jump(), instruction.nextPc});
+            ended = true;
+            break;
+        case(JL):
+        case(JLE):
+        case(JGE):
+        case(JMP):
+        case(JO):
+        case(JP):
+        case(JC):
+            // these test flag constants rather than fs, so they are always taken
+            commit(instruction.opcode);
+            exits.push_back({e.Jump(), BranchTarget(instruction)});
+            ended = true;
+            break;
+        case(CALL):
+            commit(instruction.opcode);
+            e.MovImm(R11, instruction.nextPc);
+            exits.push_back({e.Jump(), BranchTarget(instruction)});
+            ended = true;
+            break;
+        case(RET):
+        {
+            commit(instruction.opcode);
+            e.RegReg(0x89, RAX, R11);                         // mov eax, r11d
+            e.Byte(0x83); e.ModRM(3, 7, RAX); e.Byte(0xFF);   // cmp eax, -1
+            e.Byte(0x75); e.Byte(5);                          // jne +5
+            e.MovImm(RAX, pc);                                // mov eax, pc
+            e.MovImm(R11, -1);
+            e.RegFrame(0x89, RAX, FRAME(pc));
+            e.RegFrame(0x3B, RAX, FRAME(entryCount));         // cmp eax, [entryCount]
+            Link(e.JumpIf(0x3), epilogue);                    // jae
+            e.RegFrame(0x8B, RCX, FRAME(entries), true);
+            e.Byte(0x48); e.Byte(0x8B); e.Byte(0x14); e.Byte(0xC1); // mov rdx, [rcx + rax*8]
+            e.RegReg(0x85, RDX, RDX, true);
+            Link(e.JumpIf(0x4), epilogue);                    // jz
+            e.Byte(0xFF); e.ModRM(3, 4, RDX);                 // jmp rdx
+            ended = true;
+            break;
+        }
+        }
+
+        if(instruction.opcode == LOADA || instruction.opcode == STOREA || instruction.opcode == ADDA ||
+            instruction.opcode == SUBA || instruction.opcode == MULA || instruction.opcode == ANDA ||
+            instruction.opcode == ORA || instruction.opcode == XORA || instruction.opcode == CMPA)
+            lastAddress = operand;
+
+        if(ended)
+            break;
+        pc = instruction.nextPc;
+        if(pc < count && image.leaders[pc])
+            break;
+    }
+
+    // entering and leaving a short block costs more than it saves, unless it loops on itself
+    bool loops = false;
+    for(auto &exit : exits)
+        loops = loops || exit.second == start;
+    if(length == 0 || (length < JIT_MIN_BLOCK && !loops))
+    {
+        image.heat[start] = -1;
+        return nullptr;
+    }
+    if(!ended)
+    {
+        commit(lastOpcode);
+        exits.push_back({e.Jump(), pc});
+    }
+
+    memcpy(lengthCheck, &length, 4);
+    memcpy(lengthSub, &length, 4);
+    image.entries[start] = entry;
+    image.blockLengths[start] = length;
+
+    // Not enough budget left for the whole block, the interpreter finishes the quantum
+    Link(budgetExit, e.code);
+    e.StoreFrameImm(FRAME(pc), start);
+    Link(e.Jump(), epilogue);
+
+    // Link exits to compiled blocks, or to stubs that hand the pc back to the interpreter
+    // until a block gets compiled there
+    for(auto &exit : exits)
+    {
+        int target = exit.second;
+        bool inside = target >= 0 && target < count;
+        if(inside && image.entries[target] != nullptr)
+        {
+            Link(exit.first, image.entries[target]);
+            continue;
+        }
+        Link(exit.first, e.code);
+        e.StoreFrameImm(FRAME(pc), target);
+        Link(e.Jump(), epilogue);
+        if(inside)
+            image.pendingLinks[target].push_back(exit.first);
+    }
+
+    auto pending = image.pendingLinks.find(start);
+    if(pending != image.pendingLinks.end())
+    {
+        for(uint8_t *site : pending->second)
+            Link(site, entry);
+        image.pendingLinks.erase(pending);
+    }
+
+    used = e.code - buffer;
+    return entry;
+}
+
+#else
+
+bool Jit::Available()
+{
+    return false;
+}
+
+void Jit::Prepare(JitImage &image, const std::vector<DecodedInstruction> &instructions)
+{
+}
+
+const void *Jit::Compile(JitImage &image, const std::vector<DecodedInstruction> &instructions, int pc)
+{
+    return nullptr;
+}
+
+void Jit::Enter(JitFrame *frame, const void *block)
+{
+}
+
+#endif
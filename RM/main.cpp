@@ -27,7 +27,38 @@ int main(int argc, char** argv)
 
     Cpu cpu = Cpu();
 
+    // 'switch' selects the reference execution engine, 'threaded' the interpreter without the JIT,
+    // 'train' records opcode pair profiles that the loader uses for superinstructions next time,
+    // 'quantum=N' sets how many instructions a process runs before the next ready one,
+    // 'snapshot' saves the machine at the shell prompt and 'restore' starts from that snapshot,
+    // 'replace=clock|lru2|arc' picks the page replacement policy
+    bool saveSnapshot = false;
+    bool restoreSnapshot = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "switch") == 0)
+            cpu.engine = ENGINE_SWITCH;
+        else if(strcmp(argv[i], "threaded") == 0)
+            cpu.engine = ENGINE_THREADED;
+        else if(strcmp(argv[i], "train") == 0)
+            cpu.profiling = true;
+        else if(strncmp(argv[i], "quantum=", 8) == 0 && atoi(argv[i] + 8) > 0)
+            cpu.scheduler.quantum = atoi(argv[i] + 8);
+        else if(strcmp(argv[i], "snapshot") == 0)
+            saveSnapshot = true;
+        else if(strcmp(argv[i], "restore") == 0)
+            restoreSnapshot = true;
+        else if(strcmp(argv[i], "replace=clock") == 0)
+            cpu.memcontroller.SetReplacementPolicy(REPLACE_CLOCK);
+        else if(strcmp(argv[i], "replace=lru2") == 0)
+            cpu.memcontroller.SetReplacementPolicy(REPLACE_LRU2);
+        else if(strcmp(argv[i], "replace=arc") == 0)
+            cpu.memcontroller.SetReplacementPolicy(REPLACE_ARC);
+    }
+
     Clock clock = Clock(cpu, step);
+    clock.saveSnapshot = saveSnapshot;
+    clock.restoreSnapshot = restoreSnapshot;
 
     clock.Start();
     clock.Update();
@@ -1,5 +1,6 @@
 #include "memcontrol.h"
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 
 Memory Memcontrol::AllocateMemory(uint16_t size, std::vector<int> pagesToIgnore)
@@ -12,36 +13,42 @@ Memory Memcontrol::AllocateMemory(uint16_t size, std::vector<int> pagesToIgnore)
     else
         pageCount = size/PAGE_SIZE + 1;
 
-    for(int i = 0; i < PAGETABLE_SIZE; i++)
+    SyncPagePools();
+    while((int)memPageNumbers.size() < pageCount)
     {
-        if(memPageNumbers.size() == pageCount)
-            continue;
-        else if(!pageTable[i].used && !pageTable[i].onDisk && pageTable[i].frame != -1) 
-        {
-            memPageNumbers.push_back(i);
-            pageTable[i].used = true;
-        }
+        int page = FirstInPool(freeFramePool);
+        if(page == -1)
+            break;
+        memPageNumbers.push_back(page);
+        pageTable[page].used = true;
+        PageStateChanged(page);
     }
 
     int collectedPageListSize = memPageNumbers.size();
+    // pages handed out above are fresh, the policy must not take them back
+    pagesToIgnore.insert(pagesToIgnore.end(), memPageNumbers.begin(), memPageNumbers.end());
     
     for(int i = 0; i < pageCount - collectedPageListSize; i++)
     {
-        int leastAccessed = 0;
+        int victim = 0;
         int ptSize = PAGETABLE_SIZE;
-        leastAccessed = FindLeastAccessedPage(pagesToIgnore);
+        victim = FindVictimPage(pagesToIgnore);
 
-        if(leastAccessed > ptSize || leastAccessed == -1)
+        int newPage = -1;
+        if(victim <= ptSize && victim != -1)
+            newPage = MoveToSwap(victim);
+        if(newPage == -1 || pageTable[newPage].frame == -1)
         {
-            throw new std::runtime_error("Out of memory :(");
+            // If we can't find memory to swap too, it means we are out of memory. The pages
+            // collected so far go back so a failed allocation leaves nothing behind
+            FreeMemory({memPageNumbers, AddressList(memPageNumbers)});
+            throw new OutOfMemory("Out of memory :(");
         }
         
-        int newPage = MoveToSwap(leastAccessed);
-        if(newPage == -1 || pageTable[newPage].frame == -1)
-            throw new std::runtime_error("Out of memory :("); // If we can't find memory to swap too, it means we are out of memory
-        
         memPageNumbers.push_back(newPage);
+        pagesToIgnore.push_back(newPage);
         pageTable[newPage].used = true;
+        PageStateChanged(newPage);
     }
 
     for(int i : memPageNumbers)
@@ -49,45 +56,74 @@ Memory Memcontrol::AllocateMemory(uint16_t size, std::vector<int> pagesToIgnore)
         ClearPageBeforeUse(i);
     }
 
-    return {memPageNumbers, GetAddressList(memPageNumbers)};
+    return {memPageNumbers, AddressList(memPageNumbers)};
+}
+
+AddressList::AddressList(std::vector<int> pages) : pages(std::move(pages))
+{
+    for(int page : this->pages)
+    {
+        inList.set(page);
+    }
+}
+
+bool AddressList::Contains(int address) const
+{
+    int page = address >> 12;
+    return address >= 0 && page < PAGETABLE_SIZE && inList.test(page) && (address & (PAGE_SIZE - 1)) < SEGMENT_PAGE_WORDS;
+}
+
+void AddressList::Append(const AddressList &other)
+{
+    pages.insert(pages.end(), other.pages.begin(), other.pages.end());
+    inList |= other.inList;
 }
 
 void Memcontrol::FreeMemory(Memory mem)
 {
     for(auto &page : mem.usedPages)
     {
+        if(pageTable[page].copyOnWrite)
+            DetachSharedPage(page);
+        // a page left in swap becomes a spare page with its sector
+        pageTable[page].onDisk = false;
         pageTable[page].used = false;
-    
+        PageStateChanged(page);
     }
+    translationEpoch++;
 }
 
-int Memcontrol::FindLeastAccessedPage(std::vector<int> collectedPages)
+// Frees all three segments of a program that will not run again
+void Memcontrol::FreeProgram(Program &program)
 {
-    int leastAccessed = std::numeric_limits<int>::max();
-    int page = -1;
-    for(int i = 0; i < PAGETABLE_SIZE; i++)
+    for(Segment *segment : {&program.codeSegment, &program.dataSegment, &program.stackSegment})
     {
-        if(leastAccessed > pageTable[i].timesAccessed && !pageTable[i].onDisk && 
-        pageTable[i].frame != -1 &&
-        (std::find(collectedPages.begin(), collectedPages.end(), i) == collectedPages.end()))
-        {
-            leastAccessed = pageTable[i].timesAccessed;
-            if(pageTable[i].frame == -1)
-                throw;
-            page = i;
-        }
+        FreeMemory(segment->memory);
+        segment->memory = Memory();
     }
+}
+
+int Memcontrol::FindVictimPage(const std::vector<int> &collectedPages)
+{
+    // references still sitting in the TLB count towards the choice
+    FlushTlb();
+    SyncPagePools();
+    std::bitset<PAGETABLE_SIZE> pinned;
+    for(int page : collectedPages)
+        pinned.set(page);
 
- 
-    return page;
+    return replacement.Victim(pinned);
 }
 
 void Memcontrol::WriteRAM(int address, int value)
 {
     //TODO: Add memory safety (check if address is in bounds of the page)
+    if(pageTable[address >> 12].copyOnWrite)
+        BreakSharing(address >> 12);
     int physAddress = ConvertToPhysAddress(address);
 
     RAM[physAddress] = value;
+    pageTable[address >> 12].version++;
 }
 
 uint16_t Memcontrol::ReadRAM(int address)
@@ -98,8 +134,269 @@ uint16_t Memcontrol::ReadRAM(int address)
     return RAM[physAddress];
 }
 
+// Words from address to the end of its page, at most count
+static int PageRun(int address, int count)
+{
+    return std::min(count, PAGE_SIZE - (address & (PAGE_SIZE - 1)));
+}
+
+// Block operations translate every page of both ranges up front, so a page
+// fault is raised before anything is written and the instruction can restart
+void Memcontrol::PrepareBlock(int address, int count, bool write)
+{
+    if(address < 0 || count < 0 || address + count > PAGETABLE_SIZE * PAGE_SIZE)
+        throw std::runtime_error("Memory block is outside of the address space");
+    if(count == 0)
+        return;
+
+    int last = (address + count - 1) >> 12;
+    for(int page = address >> 12; page <= last && write; page++)
+    {
+        if(pageTable[page].copyOnWrite)
+            BreakSharing(page);
+    }
+}
+
+void Memcontrol::TranslateBlock(int address, int count)
+{
+    for(int page = address >> 12; count > 0 && page <= (address + count - 1) >> 12; page++)
+    {
+        ConvertToPhysAddress(page << 12);
+    }
+}
+
+int *Memcontrol::BlockRun(int address, bool write)
+{
+    if(write)
+        pageTable[address >> 12].version++;
+    return &RAM[pageTable[address >> 12].frame * PAGE_SIZE + (address & (PAGE_SIZE - 1))];
+}
+
+void Memcontrol::CopyRAM(int dest, int src, int count)
+{
+    PrepareBlock(dest, count, true);
+    PrepareBlock(src, count, false);
+    TranslateBlock(dest, count);
+    TranslateBlock(src, count);
+
+    // overlapping ranges are copied from the end when the destination is the later one
+    bool backward = dest > src && dest < src + count;
+    for(int done = 0; done < count;)
+    {
+        int left = count - done;
+        int run, to, from;
+        if(backward)
+        {
+            run = std::min(((dest + left - 1) & (PAGE_SIZE - 1)) + 1, ((src + left - 1) & (PAGE_SIZE - 1)) + 1);
+            run = std::min(run, left);
+            to = dest + left - run;
+            from = src + left - run;
+        }
+        else
+        {
+            to = dest + done;
+            from = src + done;
+            run = std::min(PageRun(to, left), PageRun(from, left));
+        }
+        std::memmove(BlockRun(to, true), BlockRun(from, false), run * sizeof(int));
+        done += run;
+    }
+}
+
+void Memcontrol::FillRAM(int dest, int value, int count)
+{
+    PrepareBlock(dest, count, true);
+    TranslateBlock(dest, count);
+
+    for(int done = 0; done < count;)
+    {
+        int run = PageRun(dest + done, count - done);
+        std::fill_n(BlockRun(dest + done, true), run, value);
+        done += run;
+    }
+}
+
+int Memcontrol::CompareRAM(int first, int second, int count)
+{
+    PrepareBlock(first, count, false);
+    PrepareBlock(second, count, false);
+    TranslateBlock(first, count);
+    TranslateBlock(second, count);
+
+    for(int done = 0; done < count;)
+    {
+        int run = std::min(PageRun(first + done, count - done), PageRun(second + done, count - done));
+        const int *a = BlockRun(first + done, false);
+        const int *b = BlockRun(second + done, false);
+        auto difference = std::mismatch(a, a + run, b);
+        if(difference.first != a + run)
+            return *difference.first < *difference.second ? -1 : 1;
+        done += run;
+    }
+    return 0;
+}
+
+// Host SIMD kernels for the vector instructions, working LANES words at a time.
+// Sums and products wrap like the guest's 32 bit words
+typedef int Lanes __attribute__((vector_size(16)));
+typedef unsigned int UnsignedLanes __attribute__((vector_size(16)));
+#define LANES 4
+
+static void AddKernel(int *dest, const int *src, int count)
+{
+    int i = 0;
+    for(; i + LANES <= count; i += LANES)
+    {
+        UnsignedLanes a, b;
+        std::memcpy(&a, dest + i, sizeof(a));
+        std::memcpy(&b, src + i, sizeof(b));
+        a += b;
+        std::memcpy(dest + i, &a, sizeof(a));
+    }
+    for(; i < count; i++)
+    {
+        dest[i] = (unsigned int)dest[i] + (unsigned int)src[i];
+    }
+}
+
+static void MultiplyKernel(int *dest, const int *src, int count)
+{
+    int i = 0;
+    for(; i + LANES <= count; i += LANES)
+    {
+        UnsignedLanes a, b;
+        std::memcpy(&a, dest + i, sizeof(a));
+        std::memcpy(&b, src + i, sizeof(b));
+        a *= b;
+        std::memcpy(dest + i, &a, sizeof(a));
+    }
+    for(; i < count; i++)
+    {
+        dest[i] = (unsigned int)dest[i] * (unsigned int)src[i];
+    }
+}
+
+static int SumKernel(const int *words, int count, int sum)
+{
+    UnsignedLanes lanes = {0, 0, 0, 0};
+    int i = 0;
+    for(; i + LANES <= count; i += LANES)
+    {
+        UnsignedLanes v;
+        std::memcpy(&v, words + i, sizeof(v));
+        lanes += v;
+    }
+    unsigned int total = (unsigned int)sum + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for(; i < count; i++)
+    {
+        total += (unsigned int)words[i];
+    }
+    return total;
+}
+
+static int MinKernel(const int *words, int count, int min)
+{
+    Lanes lanes = {min, min, min, min};
+    int i = 0;
+    for(; i + LANES <= count; i += LANES)
+    {
+        Lanes v;
+        std::memcpy(&v, words + i, sizeof(v));
+        lanes = v < lanes ? v : lanes;
+    }
+    for(int lane = 0; lane < LANES; lane++)
+    {
+        min = std::min(min, (int)lanes[lane]);
+    }
+    for(; i < count; i++)
+    {
+        min = std::min(min, words[i]);
+    }
+    return min;
+}
+
+static int MaxKernel(const int *words, int count, int max)
+{
+    Lanes lanes = {max, max, max, max};
+    int i = 0;
+    for(; i + LANES <= count; i += LANES)
+    {
+        Lanes v;
+        std::memcpy(&v, words + i, sizeof(v));
+        lanes = v > lanes ? v : lanes;
+    }
+    for(int lane = 0; lane < LANES; lane++)
+    {
+        max = std::max(max, (int)lanes[lane]);
+    }
+    for(; i < count; i++)
+    {
+        max = std::max(max, words[i]);
+    }
+    return max;
+}
+
+// Runs kernel over both ranges a page run at a time, front to back
+void Memcontrol::CombineRAM(int dest, int src, int count, void (*kernel)(int*, const int*, int))
+{
+    PrepareBlock(dest, count, true);
+    PrepareBlock(src, count, false);
+    TranslateBlock(dest, count);
+    TranslateBlock(src, count);
+
+    for(int done = 0; done < count;)
+    {
+        int run = std::min(PageRun(dest + done, count - done), PageRun(src + done, count - done));
+        kernel(BlockRun(dest + done, true), BlockRun(src + done, false), run);
+        done += run;
+    }
+}
+
+int Memcontrol::ReduceRAM(int address, int count, int initial, int (*kernel)(const int*, int, int))
+{
+    PrepareBlock(address, count, false);
+    TranslateBlock(address, count);
+
+    int result = initial;
+    for(int done = 0; done < count;)
+    {
+        int run = PageRun(address + done, count - done);
+        result = kernel(BlockRun(address + done, false), run, result);
+        done += run;
+    }
+    return result;
+}
+
+void Memcontrol::AddRAM(int dest, int src, int count)
+{
+    CombineRAM(dest, src, count, AddKernel);
+}
+
+void Memcontrol::MultiplyRAM(int dest, int src, int count)
+{
+    CombineRAM(dest, src, count, MultiplyKernel);
+}
+
+int Memcontrol::SumRAM(int address, int count)
+{
+    return ReduceRAM(address, count, 0, SumKernel);
+}
+
+int Memcontrol::MinRAM(int address, int count)
+{
+    return ReduceRAM(address, count, std::numeric_limits<int>::max(), MinKernel);
+}
+
+int Memcontrol::MaxRAM(int address, int count)
+{
+    return ReduceRAM(address, count, std::numeric_limits<int>::min(), MaxKernel);
+}
+
 int Memcontrol::MoveToSwap(int pageNumber)
 {
+    if(pageTable[pageNumber].copyOnWrite)
+        return -1;
+
     std::array<int, PAGE_SIZE> pageData;
     int memStart = pageTable[pageNumber].frame * PAGE_SIZE;
    
@@ -112,48 +409,242 @@ int Memcontrol::MoveToSwap(int pageNumber)
         pageData[i] = RAM[memStart+i];
     }
 
-    int foundSector = -1;
-    int foundNewPage = -1;
-    for(int i = 0; i < PAGETABLE_SIZE; i++)
+    SyncPagePools();
+    int foundNewPage = FirstInPool(freeSectorPool, pageNumber);
+    if(foundNewPage == -1)
     {
-        if(!pageTable[i].used && !pageTable[i].onDisk && i != pageNumber && pageTable[i].swapSector != -1)
+        return -1;
+    }
+    int foundSector = pageTable[foundNewPage].swapSector;
+
+    pageTable[pageNumber].swapSector = foundSector;
+    // a read still running for the page that had this sector before must not see the new data
+    if(iocontroller.SwapReadStarted(foundSector))
+        iocontroller.FinishSwapRead(foundSector);
+    iocontroller.WriteSwapData(foundSector, pageData);
+    swapOuts++;
+
+    pageTable[foundNewPage].onDisk = false;
+    pageTable[foundNewPage].swapSector = -1;
+    pageTable[foundNewPage].used = false;
+    pageTable[foundNewPage].frame = pageTable[pageNumber].frame;
+
+    pageTable[pageNumber].used = false;
+    pageTable[pageNumber].frame = -1;
+    pageTable[pageNumber].onDisk = true;
+    pageTable[pageNumber].version++;
+    pageTable[foundNewPage].version++;
+    PageStateChanged(pageNumber);
+    PageStateChanged(foundNewPage);
+    translationEpoch++;
+    FlushTlb();
+    return foundNewPage;
+}
+
+// Every frame has one page owning it with no swap sector, the other pages sharing
+// it are spare pages that keep theirs, so they can go back to being spare
+Memory Memcontrol::ShareMemory(Memory memory)
+{
+    for(int page : memory.usedPages)
+    {
+        if(pageTable[page].onDisk || pageTable[page].frame == -1)
+            return {};
+    }
+
+    SyncPagePools();
+    std::vector<int> spare;
+    for(int word = 0; word < (int)freeSectorPool.size(); word++)
+    {
+        for(uint64_t bits = freeSectorPool[word]; bits != 0; bits &= bits - 1)
         {
-            foundSector = pageTable[i].swapSector;
-            foundNewPage = i;
-            break;
+            int i = word * 64 + __builtin_ctzll(bits);
+            if(pageTable[i].frame == -1)
+                spare.push_back(i);
         }
     }
+    if(spare.size() < memory.usedPages.size() + SPARE_PAGE_RESERVE)
+        return {};
+    spare.resize(memory.usedPages.size());
 
-    if(foundSector == -1)
+    for(int i = 0; i < (int)spare.size(); i++)
     {
-        return -1;
+        Page &source = pageTable[memory.usedPages[i]];
+        Page &alias = pageTable[spare[i]];
+        alias.frame = source.frame;
+        alias.used = true;
+        alias.timesAccessed = 0;
+        alias.copyOnWrite = true;
+        alias.version++;
+        source.copyOnWrite = true;
+        frameTable[source.frame]++;
+        PageStateChanged(memory.usedPages[i]);
+        PageStateChanged(spare[i]);
     }
-    else
+    translationEpoch++;
+    return {spare, AddressList(spare)};
+}
+
+// Unmaps page from the frame it shares and leaves it with a swap sector, like any spare page
+void Memcontrol::DetachSharedPage(int page)
+{
+    int frame = pageTable[page].frame;
+    if(pageTable[page].swapSector == -1)
     {
-        pageTable[pageNumber].swapSector = foundSector;
-        iocontroller.WriteSwapData(foundSector, pageData);
+        // the page owned the frame, another one sharing it takes over
+        for(int i = 0; i < PAGETABLE_SIZE; i++)
+        {
+            if(i != page && pageTable[i].frame == frame)
+            {
+                pageTable[page].swapSector = pageTable[i].swapSector;
+                pageTable[i].swapSector = -1;
+                PageStateChanged(i);
+                break;
+            }
+        }
+    }
+    pageTable[page].frame = -1;
+    pageTable[page].copyOnWrite = false;
+    pageTable[page].version++;
+    PageStateChanged(page);
+    translationEpoch++;
+
+    if(--frameTable[frame] == 1)
+    {
+        for(int i = 0; i < PAGETABLE_SIZE; i++)
+        {
+            if(pageTable[i].frame == frame)
+            {
+                pageTable[i].copyOnWrite = false;
+                PageStateChanged(i);
+            }
+        }
+    }
+}
+
+// Gives page a frame of its own with a copy of the one it shared
+void Memcontrol::BreakSharing(int page)
+{
+    int freePage = TakeFreeFrame({page});
+    int frame = pageTable[freePage].frame;
+    std::copy_n(RAM.begin() + pageTable[page].frame * PAGE_SIZE, PAGE_SIZE, RAM.begin() + frame * PAGE_SIZE);
+    DetachSharedPage(page);
 
-        pageTable[foundNewPage].onDisk = false;
-        pageTable[foundNewPage].swapSector = -1;
-        pageTable[foundNewPage].used = false;
-        pageTable[foundNewPage].frame = pageTable[pageNumber].frame;
+    // the same trade as in MoveToSwap, the free page keeps the sector
+    pageTable[freePage].swapSector = pageTable[page].swapSector;
+    pageTable[freePage].frame = -1;
+    pageTable[freePage].version++;
+    pageTable[page].swapSector = -1;
+    pageTable[page].frame = frame;
+    PageStateChanged(freePage);
+    PageStateChanged(page);
+    translationEpoch++;
+}
 
-        pageTable[pageNumber].used = false;
-        pageTable[pageNumber].frame = -1;
-        pageTable[pageNumber].onDisk = true;
-        return foundNewPage;
+// An unused page holding a frame, a victim is swapped out for it if there is none
+int Memcontrol::TakeFreeFrame(const std::vector<int> &pinned)
+{
+    SyncPagePools();
+    int freePage = FirstInPool(freeFramePool);
+    if(freePage == -1)
+    {
+        int victim = FindVictimPage(pinned);
+        if(victim != -1)
+            freePage = MoveToSwap(victim);
+        if(freePage == -1 || pageTable[freePage].frame == -1)
+            throw new OutOfMemory("Out of memory :(");
     }
+    return freePage;
 }
 
 std::array<int, PAGE_SIZE> Memcontrol::GetFromSwap(int pageNumber)
 {
-    std::array<int, PAGE_SIZE> data = iocontroller.ReadSwapData(pageTable[pageNumber].swapSector);
-    return data;
+    int sector = pageTable[pageNumber].swapSector;
+    swapIns++;
+    if(iocontroller.SwapReadStarted(sector))
+    {
+        std::array<int, PAGE_SIZE> data = iocontroller.FinishSwapRead(sector);
+        iocontroller.DiscardSwapData(sector);
+        return data;
+    }
+    return iocontroller.ReadSwapData(sector);
+}
+
+void Memcontrol::EndSlice()
+{
+    std::vector<int> &pages = workingSets[activeProcessId];
+    pages.clear();
+    for(int page = 0; page < PAGETABLE_SIZE; page++)
+    {
+        if(sliceTouched.test(page))
+            pages.push_back(page);
+    }
+    sliceTouched.reset();
+}
+
+void Memcontrol::Prefetch(int processId)
+{
+    CancelPrefetch();
+    for(int page : workingSets[processId])
+    {
+        if(prefetching.size() == PREFETCH_PAGES)
+            break;
+        if(!pageTable[page].onDisk || pageTable[page].swapSector == -1)
+            continue;
+        iocontroller.StartSwapRead(pageTable[page].swapSector);
+        prefetching.push_back({page, pageTable[page].swapSector});
+    }
+    prefetchProcess = processId;
+}
+
+// Pages that left swap some other way since the read started are skipped,
+// their reads are only waited for
+void Memcontrol::CompletePrefetch(int processId)
+{
+    if(processId != prefetchProcess)
+    {
+        CancelPrefetch();
+        return;
+    }
+
+    std::vector<int> pinned;
+    for(auto &entry : prefetching)
+    {
+        pinned.push_back(entry.first);
+    }
+
+    for(auto &entry : prefetching)
+    {
+        int page = entry.first;
+        if(!pageTable[page].onDisk || pageTable[page].swapSector != entry.second)
+            continue;
+        try
+        {
+            SwapIn(page, pinned);
+            prefetchedPages++;
+        }
+        catch(std::runtime_error *error)
+        {
+            // out of frames, the rest waits for a fault
+            delete error;
+            break;
+        }
+    }
+    CancelPrefetch();
+}
+
+void Memcontrol::CancelPrefetch()
+{
+    for(auto &entry : prefetching)
+    {
+        if(iocontroller.SwapReadStarted(entry.second))
+            iocontroller.FinishSwapRead(entry.second);
+    }
+    prefetching.clear();
 }
 
 void Memcontrol::WriteSegment(Segment segment, int address, int value)
 {
-    if(std::find(segment.memory.addresses.begin(), segment.memory.addresses.end(), address) != segment.memory.addresses.end())
+    if(segment.memory.addresses.Contains(address))
     {
         WriteRAM(address, value);
     }
@@ -179,38 +670,20 @@ Segment Memcontrol::InitSegment(int direction, int pageCount)
     segment.memory = AllocateMemory(PAGE_SIZE * pageCount);
 
     pageNumber = segment.memory.usedPages[0];
-    //segment.writePointer = (pageNumber << 12) & 0b11111111100000000000;
-    //segment.startPointer = (pageNumber << 12) & 0b11111111100000000000;
-    segment.writePointer = pageTable[pageNumber].frame * PAGE_SIZE;
-    segment.startPointer = pageTable[pageNumber].frame * PAGE_SIZE;
+    // virtual, so variables follow the page wherever it is swapped in
+    segment.writePointer = pageNumber << 12;
+    segment.startPointer = pageNumber << 12;
 
     return segment;
 }
 
-std::vector<int> Memcontrol::GetAddressList(std::vector<int> pages)
-{
-    std::vector<int> addressList;
-    int z = 0b111111111111;
-
-    for(auto &p : pages)
-    {
-        int k = p << 12;
-        for(int i = 0; i < z; i++)
-        {
-            addressList.push_back(k + i);
-        }
-    }
-
-    int x = addressList.size();
-
-    return addressList;
-}
-
 Memcontrol::Memcontrol()
 {
     activeProcessId = -1;
+    frameTable.fill(1);
     for(int i = 0; i < PAGETABLE_SIZE; i++)
     {
+        pageTable[i].copyOnWrite = false;
         pageTable[i].frame = i;
         pageTable[i].timesAccessed = 0;
         pageTable[i].used = false;
@@ -222,6 +695,85 @@ Memcontrol::Memcontrol()
             pageTable[i].frame = -1;
         }
     }
+    translationEpoch++;
+    pageStateEpoch++;
+    SyncPagePools();
+}
+
+void Memcontrol::SyncPagePools()
+{
+    if(poolEpoch == pageStateEpoch && !freeFramePool.empty())
+        return;
+
+    freeFramePool.assign((PAGETABLE_SIZE + 63) / 64, 0);
+    freeSectorPool.assign((PAGETABLE_SIZE + 63) / 64, 0);
+    for(int i = 0; i < PAGETABLE_SIZE; i++)
+    {
+        if(pageTable[i].used || pageTable[i].onDisk)
+            continue;
+        if(pageTable[i].frame != -1)
+            freeFramePool[i / 64] |= 1ull << (i % 64);
+        if(pageTable[i].swapSector != -1)
+            freeSectorPool[i / 64] |= 1ull << (i % 64);
+    }
+
+    replacement.Reset();
+    for(int i = 0; i < PAGETABLE_SIZE; i++)
+    {
+        if(!pageTable[i].onDisk && pageTable[i].frame != -1 && !pageTable[i].copyOnWrite)
+            replacement.Inserted(i);
+    }
+    poolEpoch = pageStateEpoch;
+}
+
+// Pools of an up to date Memcontrol follow the change, any other one rebuilds
+// its pools the next time it needs them
+void Memcontrol::PageStateChanged(int page)
+{
+    bool current = poolEpoch == pageStateEpoch && !freeFramePool.empty();
+    pageStateEpoch++;
+    if(!current)
+        return;
+
+    uint64_t bit = 1ull << (page % 64);
+    bool free = !pageTable[page].used && !pageTable[page].onDisk;
+    if(free && pageTable[page].frame != -1)
+        freeFramePool[page / 64] |= bit;
+    else
+        freeFramePool[page / 64] &= ~bit;
+    if(free && pageTable[page].swapSector != -1)
+        freeSectorPool[page / 64] |= bit;
+    else
+        freeSectorPool[page / 64] &= ~bit;
+
+    // the policy sees a freed page as a new one that was never referenced
+    const Page &state = pageTable[page];
+    bool resident = !state.onDisk && state.frame != -1 && !state.copyOnWrite;
+    if(!resident || !state.used)
+        replacement.Removed(page, state.onDisk);
+    if(resident)
+        replacement.Inserted(page);
+    poolEpoch = pageStateEpoch;
+}
+
+void Memcontrol::SetReplacementPolicy(ReplacementKind kind)
+{
+    replacement.kind = kind;
+    freeFramePool.clear(); // rebuilds the policy with the pools
+    SyncPagePools();
+}
+
+int Memcontrol::FirstInPool(const std::vector<uint64_t> &pool, int skip)
+{
+    for(int word = 0; word < (int)pool.size(); word++)
+    {
+        uint64_t bits = pool[word];
+        if(skip / 64 == word && skip != -1)
+            bits &= ~(1ull << (skip % 64));
+        if(bits != 0)
+            return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
 }
 
 int Memcontrol::FindPtrAddress()
@@ -229,212 +781,334 @@ int Memcontrol::FindPtrAddress()
     return 0;
 }
 
-int Memcontrol::FindVarAddress(Program program, int var)
+int Memcontrol::FindVarAddress(const Program &program, int var)
+{
+    auto slot = program.variables.find(var);
+    if(slot == program.variables.end())
+        throw new std::runtime_error("Failed to find variable");
+
+    return program.dataSegment.startPointer + slot->second;
+}
+
+int Memcontrol::GetVarAddrIfExists(const Program &program, int var)
 {
-    int startAddress = program.dataSegment.startPointer;
-    for(int i = 0; i < program.dataSegment.memory.addresses.size(); i+=2)
+    auto slot = program.variables.find(var);
+    if(slot == program.variables.end())
+        return -1;
+
+    return program.dataSegment.startPointer + slot->second;
+}
+
+// The page fault handler, the faulting instruction is restarted once the page is back
+void Memcontrol::SwapIn(int page, const std::vector<int> &pinned)
+{
+    if(!pageTable[page].onDisk)
+        return;
+
+    int freePage = TakeFreeFrame(pinned);
+    int frame = pageTable[freePage].frame;
+    std::array<int, PAGE_SIZE> data = GetFromSwap(page);
+    std::copy(data.begin(), data.end(), RAM.begin() + frame * PAGE_SIZE);
+
+    // the free page keeps the sector and becomes a spare page
+    pageTable[freePage].swapSector = pageTable[page].swapSector;
+    pageTable[freePage].frame = -1;
+    pageTable[freePage].version++;
+    pageTable[page].swapSector = -1;
+    pageTable[page].frame = frame;
+    pageTable[page].onDisk = false;
+    pageTable[page].used = true;
+    pageTable[page].version++;
+    PageStateChanged(freePage);
+    PageStateChanged(page);
+    translationEpoch++;
+}
+
+int Memcontrol::ConvertToPhysAddress(int addr)
+{
+    int pageNumber = addr & 0b111111111100000000000;
+    pageNumber = pageNumber >> 12;
+    int offset = addr - PAGE_SIZE*pageNumber;
+
+    // hits stay in the entry, the page table is only written on a miss
+    TlbEntry &entry = tlb[pageNumber & (TLB_SIZE - 1)];
+    if(entry.page == pageNumber && tlbEpoch == translationEpoch)
     {
-        int p = RAM[startAddress+i];
-        if(p == var)
-        {
-            return startAddress+i;
-        }
+        entry.hits++;
+        return entry.frameStart + offset;
     }
+    return TranslateMiss(pageNumber, offset);
+}
+
+int Memcontrol::TranslateMiss(int pageNumber, int offset)
+{
+    if(tlbEpoch != translationEpoch)
+        FlushTlb();
 
-    throw new std::runtime_error("Failed to find variable");
+    if(pageTable[pageNumber].onDisk)
+    {
+        pageFaults++;
+        throw new PageFault(pageNumber);
+    }
+
+    pageTable[pageNumber].timesAccessed++;
+    pageHits++;
+    sliceTouched.set(pageNumber);
+    if(!pageTable[pageNumber].used)
+    {
+        pageTable[pageNumber].used = true;
+        PageStateChanged(pageNumber);
+    }
+    replacement.Referenced(pageNumber);
+
+    TlbEntry &entry = tlb[pageNumber & (TLB_SIZE - 1)];
+    if(entry.page != -1)
+        CountAccesses(entry.page, entry.hits);
+    entry = {pageNumber, pageTable[pageNumber].frame * PAGE_SIZE, 0};
+
+    return entry.frameStart + offset;
 }
 
-int Memcontrol::GetVarAddrIfExists(Program program, int var)
+void Memcontrol::FlushTlb()
 {
-    int startAddress = ConvertToPhysAddress(program.dataSegment.startPointer);
-    int varAddr = -1;
-    for(int i = 0; i < program.dataSegment.memory.addresses.size(); i+=2)
+    for(TlbEntry &entry : tlb)
     {
-        if(RAM[startAddress+i] == var)
-        {
-            varAddr = startAddress+i;
-        }
+        if(entry.page != -1)
+            CountAccesses(entry.page, entry.hits);
+        entry.page = -1;
     }
-    return varAddr;
-}  
+    tlbEpoch = translationEpoch;
+}
 
-Program Memcontrol::PrepareProgramMemory(Program program)
+void Memcontrol::CountAccesses(int page, int count)
 {
-    std::vector<int> pagesToIgnore;
-    pagesToIgnore.insert(pagesToIgnore.end(),
-    program.codeSegment.memory.usedPages.begin(),
-    program.codeSegment.memory.usedPages.end());
-    
-    pagesToIgnore.insert(pagesToIgnore.end(),
-    program.stackSegment.memory.usedPages.begin(),
-    program.stackSegment.memory.usedPages.end());
+    pageTable[page].timesAccessed += count;
+    pageHits += count;
+    if(count > 0)
+    {
+        sliceTouched.set(page);
+        replacement.Referenced(page);
+    }
+}
 
-    pagesToIgnore.insert(pagesToIgnore.end(),
-    program.dataSegment.memory.usedPages.begin(),
-    program.dataSegment.memory.usedPages.end());
+void Memcontrol::ClearPageBeforeUse(int page)
+{
+    int physAddress = ConvertToPhysAddress(page << 12);
+    std::fill_n(&RAM[physAddress], SEGMENT_PAGE_WORDS, 0);
+    pageTable[page].version++;
+}
 
-    for(auto i : program.codeSegment.memory.usedPages)
+HeapBlockHandler Memcontrol::HeapAlloc(int owner, int size, int slack)
+{
+    if(HeapBlockHandlers.empty())
+        RebuildHeapIndex();
+
+    // room for the string, the word StoreStringInHeap skips and the terminator after it
+    int needed = size + slack + 2;
+    int lower = 31 - __builtin_clz(needed);
+    int smallest = needed == 1 << lower ? lower : lower + 1;
+
+    // a freed block of the same class is reused if the first one fits, otherwise
+    // every block of class smallest or above fits and the lowest such list is taken
+    int entry = -1;
+    unsigned int fitting = smallest < HEAP_CLASSES ? heapIndex.nonEmptyClasses & ~((1u << smallest) - 1) : 0;
+    if(lower < HEAP_CLASSES && heapIndex.freeLists[lower] != -1 && HeapBlockHandlers[heapIndex.freeLists[lower]].capacity >= needed)
+    {
+        entry = heapIndex.freeLists[lower];
+    }
+    else if(fitting != 0)
     {
-        if(pageTable[i].onDisk || pageTable[i].frame == -1)
+        entry = heapIndex.freeLists[__builtin_ctz(fitting)];
+    }
+    else if(lower < HEAP_CLASSES)
+    {
+        // the rest of the class below may still hold a block big enough, only searched when nothing else fits
+        for(int i = heapIndex.freeLists[lower]; i != -1; i = HeapBlockHandlers[i].nextFree)
         {
-            int lu = FindLeastAccessedPage(pagesToIgnore);
-            int newPage = MoveToSwap(lu);
-            std::array<int, PAGE_SIZE> data = GetFromSwap(i);
-            pageTable[newPage].swapSector = pageTable[i].swapSector;
-            pageTable[newPage].onDisk = true;
-            pageTable[i].onDisk = false;
-            pageTable[i].used = true;
-            pageTable[newPage].used = false;
-            pageTable[i].frame = pageTable[newPage].frame;
-            pageTable[i].swapSector = -1;
-            pageTable[newPage].frame = -1;
-            for(int j = 0; j < PAGE_SIZE; j++)
+            if(HeapBlockHandlers[i].capacity >= needed)
             {
-                int addr = pageTable[i].frame * PAGE_SIZE;
-                RAM[addr + j] = data[j];
+                entry = i;
+                break;
             }
         }
     }
+    if(entry == -1)
+        throw new OutOfMemory("No more heap memory");
 
-    for(auto i : program.stackSegment.memory.usedPages)
+    UnlinkFreeBlock(entry);
+    int rest = HeapBlockHandlers[entry].capacity - needed;
+    if(rest >= HEAP_MIN_SPLIT)
     {
-        if(pageTable[i].onDisk || pageTable[i].frame == -1)
+        HeapBlockHandlers[entry].capacity = needed;
+        PushFreeBlock(NewHeapEntry(HeapBlockHandlers[entry].start + needed, rest));
+    }
+
+    HeapBlockHandler &block = HeapBlockHandlers[entry];
+    block.owner = owner;
+    block.size = size;
+    block.free = false;
+    TagHeapBlock(entry);
+    heapBytesAllocated += size;
+    return block;
+}
+
+void Memcontrol::HeapFree(int start)
+{
+    int entry = HeapEntryAt(start);
+    if(entry == -1)
+        return;
+
+    // free neighbours are merged in, their entries are kept for later splits
+    int end = start + HeapBlockHandlers[entry].capacity;
+    if(end < RAM_SIZE)
+    {
+        int next = heapIndex.blockAt[end - HEAP_START];
+        if(HeapBlockHandlers[next].free)
         {
-            int lu = FindLeastAccessedPage(pagesToIgnore);
-            int newPage = MoveToSwap(lu);
-            std::array<int, PAGE_SIZE> data = GetFromSwap(i);
-            pageTable[newPage].swapSector = pageTable[i].swapSector;
-            pageTable[newPage].onDisk = true;
-            pageTable[i].onDisk = false;
-            pageTable[i].used = true;
-            pageTable[newPage].used = false;
-            pageTable[i].frame = pageTable[newPage].frame;
-            pageTable[i].swapSector = -1;
-            pageTable[newPage].frame = -1;
-            for(int j = 0; j < PAGE_SIZE; j++)
-            {
-                int addr = pageTable[i].frame * PAGE_SIZE;
-                RAM[addr + j] = data[j];
-            }
+            UnlinkFreeBlock(next);
+            HeapBlockHandlers[entry].capacity += HeapBlockHandlers[next].capacity;
+            HeapBlockHandlers[next].start = -1;
+            heapIndex.unusedEntries.push_back(next);
         }
     }
-
-    for(auto i : program.dataSegment.memory.usedPages)
+    if(start > HEAP_START)
     {
-        if(pageTable[i].onDisk || pageTable[i].frame == -1)
+        int prev = heapIndex.blockAt[start - 1 - HEAP_START];
+        if(HeapBlockHandlers[prev].free)
         {
-            int lu = FindLeastAccessedPage(pagesToIgnore);
-            int newPage = MoveToSwap(lu);
-            std::array<int, PAGE_SIZE> data = GetFromSwap(i);
-            pageTable[newPage].swapSector = pageTable[i].swapSector;
-            pageTable[newPage].onDisk = true;
-            pageTable[i].onDisk = false;
-            pageTable[i].used = true;
-            pageTable[newPage].used = false;
-            pageTable[i].frame = pageTable[newPage].frame;
-            pageTable[i].swapSector = -1;
-            pageTable[newPage].frame = -1;
-            for(int j = 0; j < PAGE_SIZE; j++)
-            {
-                int addr = pageTable[i].frame * PAGE_SIZE;
-                RAM[addr + j] = data[j];
-            }
+            UnlinkFreeBlock(prev);
+            HeapBlockHandlers[prev].capacity += HeapBlockHandlers[entry].capacity;
+            HeapBlockHandlers[entry].start = -1;
+            heapIndex.unusedEntries.push_back(entry);
+            entry = prev;
         }
     }
 
-    program.codeSegment.memory.addresses = GetAddressList(program.codeSegment.memory.usedPages);
-    program.stackSegment.memory.addresses = GetAddressList(program.stackSegment.memory.usedPages);
-    program.dataSegment.memory.addresses = GetAddressList(program.dataSegment.memory.usedPages);
-
-    /*program.codeSegment.startPointer = program.codeSegment.memory.addresses[0];
-    program.stackSegment.startPointer = program.stackSegment.memory.addresses[program.stackSegment.memory.addresses.size()-1];
-    program.dataSegment.startPointer = program.dataSegment.memory.addresses[0];
-   
-    program.codeSegment.writePointer = program.codeSegment.memory.addresses[0];
-    program.stackSegment.writePointer = program.stackSegment.memory.addresses[program.stackSegment.memory.addresses.size()-1];
-    program.dataSegment.writePointer = program.dataSegment.memory.addresses[0];*/
-
-    return program;
+    HeapBlockHandlers[entry].owner = -1;
+    HeapBlockHandlers[entry].size = 0;
+    TagHeapBlock(entry);
+    PushFreeBlock(entry);
 }
 
-
-int Memcontrol::ConvertToPhysAddress(int addr)
+// Frees every used block of a process that exited
+void Memcontrol::HeapFreeOwnedBy(int owner)
 {
-    int pageNumber = addr & 0b111111111100000000000;
-    pageNumber = pageNumber >> 12;
-    int offset = addr - PAGE_SIZE*pageNumber;
-    int frameNumber = pageTable[pageNumber].frame;
-
-    if(pageTable[pageNumber].onDisk)
+    std::vector<int> starts;
+    for(const HeapBlockHandler &block : HeapBlockHandlers)
     {
-        throw new std::runtime_error("Unhandled page fault");
+        if(!block.free && block.start != -1 && block.owner == owner)
+            starts.push_back(block.start);
+    }
+    for(int start : starts)
+    {
+        HeapFree(start);
     }
-
-    int physAddress = frameNumber * PAGE_SIZE + offset;
-
-    pageTable[pageNumber].timesAccessed++;
-    pageTable[pageNumber].used = true;
-    
-    return physAddress;
 }
 
-void Memcontrol::ClearPageBeforeUse(int page)
+HeapBlockHandler Memcontrol::FindHeapBlock(int start)
 {
-    std::vector<int> temp;
-    temp.push_back(page);
-    std::vector<int> addresses;
+    int entry = HeapEntryAt(start);
+    if(entry == -1)
+        return {-1, -1, start, false, 0, -1, -1};
+    return HeapBlockHandlers[entry];
+}
 
-    addresses = GetAddressList(temp);
+void Memcontrol::RebuildHeapIndex()
+{
+    heapIndex.blockAt.assign(HEAP_SIZE, 0);
+    heapIndex.freeLists.fill(-1);
+    heapIndex.nonEmptyClasses = 0;
+    heapIndex.unusedEntries.clear();
 
-    int startAddr = pageTable[page].frame;
-    for(int i = 0; i < addresses.size(); i++)
+    if(HeapBlockHandlers.empty())
     {
-        RAM[ConvertToPhysAddress(addresses[i])] = 0;
+        PushFreeBlock(NewHeapEntry(HEAP_START, HEAP_SIZE));
+        return;
     }
-}
 
-HeapBlockHandler Memcontrol::HeapAlloc(Program owner, int size)
-{
-    HeapBlockHandler newBlock;
-
-    for(auto block : HeapBlockHandlers)
+    // the free list links are kept in the blocks, only the heads need finding
+    for(int i = 0; i < (int)HeapBlockHandlers.size(); i++)
     {
-        if(block.free && block.size <= size)
+        const HeapBlockHandler &block = HeapBlockHandlers[i];
+        if(block.start == -1)
         {
-            //allocate here
-            newBlock.start = block.start;
-            newBlock.size = size;
-            newBlock.owner = owner;
+            heapIndex.unusedEntries.push_back(i);
+            continue;
+        }
+        TagHeapBlock(i);
+        if(block.free && block.prevFree == -1)
+        {
+            int sizeClass = 31 - __builtin_clz(block.capacity);
+            heapIndex.freeLists[sizeClass] = i;
+            heapIndex.nonEmptyClasses |= 1u << sizeClass;
         }
     }
-    if(HeapBlockHandlers.size() > 0 && 
-    HeapBlockHandlers.back().start + HeapBlockHandlers.back().size + size <= RAM_SIZE)
-    {
-        //allocate here
-        newBlock.start = HeapBlockHandlers.back().start + HeapBlockHandlers.back().size + 1;
-        newBlock.size = size;
-        newBlock.owner = owner;
-    }
-    else if(HeapBlockHandlers.size() == 0)
+}
+
+int Memcontrol::NewHeapEntry(int start, int capacity)
+{
+    HeapBlockHandler block = {-1, 0, start, true, capacity, -1, -1};
+    int entry;
+    if(heapIndex.unusedEntries.empty())
     {
-        //allocate here
-        newBlock.start = HEAP_START;
-        newBlock.size = size;
-        newBlock.owner = owner;
+        entry = HeapBlockHandlers.size();
+        HeapBlockHandlers.push_back(block);
     }
     else
     {
-        std::cout << "No more heap memory" << std::endl;
-        throw std::runtime_error("No more heap memory");
+        entry = heapIndex.unusedEntries.back();
+        heapIndex.unusedEntries.pop_back();
+        HeapBlockHandlers[entry] = block;
     }
-    newBlock.free = false;
-    HeapBlockHandlers.insert(HeapBlockHandlers.end(), newBlock);
-    return newBlock;
+    TagHeapBlock(entry);
+    return entry;
 }
 
-void Memcontrol::HeapFree(HeapBlockHandler *handler)
+int Memcontrol::HeapEntryAt(int start)
 {
-    handler->free = true;
+    if(start < HEAP_START || start >= RAM_SIZE || HeapBlockHandlers.empty())
+        return -1;
+    // only block edges are kept up to date, anything else has to be checked against the entry
+    int entry = heapIndex.blockAt[start - HEAP_START];
+    if(HeapBlockHandlers[entry].start != start || HeapBlockHandlers[entry].free)
+        return -1;
+    return entry;
+}
+
+void Memcontrol::TagHeapBlock(int entry)
+{
+    const HeapBlockHandler &block = HeapBlockHandlers[entry];
+    heapIndex.blockAt[block.start - HEAP_START] = entry;
+    heapIndex.blockAt[block.start - HEAP_START + block.capacity - 1] = entry;
+}
+
+void Memcontrol::PushFreeBlock(int entry)
+{
+    HeapBlockHandler &block = HeapBlockHandlers[entry];
+    int sizeClass = 31 - __builtin_clz(block.capacity);
+    block.free = true;
+    block.prevFree = -1;
+    block.nextFree = heapIndex.freeLists[sizeClass];
+    if(block.nextFree != -1)
+        HeapBlockHandlers[block.nextFree].prevFree = entry;
+    heapIndex.freeLists[sizeClass] = entry;
+    heapIndex.nonEmptyClasses |= 1u << sizeClass;
+}
+
+void Memcontrol::UnlinkFreeBlock(int entry)
+{
+    HeapBlockHandler &block = HeapBlockHandlers[entry];
+    int sizeClass = 31 - __builtin_clz(block.capacity);
+    if(block.prevFree != -1)
+        HeapBlockHandlers[block.prevFree].nextFree = block.nextFree;
+    else
+        heapIndex.freeLists[sizeClass] = block.nextFree;
+    if(block.nextFree != -1)
+        HeapBlockHandlers[block.nextFree].prevFree = block.prevFree;
+    if(heapIndex.freeLists[sizeClass] == -1)
+        heapIndex.nonEmptyClasses &= ~(1u << sizeClass);
+    block.prevFree = -1;
+    block.nextFree = -1;
 }
 
 void Memcontrol::StoreStringInHeap(HeapBlockHandler handler, std::string str)
@@ -465,9 +1139,49 @@ std::string Memcontrol::ReadStringFromHeap(HeapBlockHandler handler)
     return str;
 }
 
-int Memcontrol::ForkProcess(std::vector<std::string> args, Program program)
+bool Memcontrol::HeapAppend(int start, const std::string &str)
 {
+    int entry = HeapEntryAt(start);
+    if(entry == -1)
+        return false;
+    HeapBlockHandler &block = HeapBlockHandlers[entry];
+
+    // strings keep their terminating zero, the appended one is written over it
+    int end = block.size;
+    if(end > 0 && RAM[start+end-1] == 0)
+        end--;
+    if(end + (int)str.length() + 2 > block.capacity)
+        return false;
+
+    for(int i = 0; i < str.length(); i++)
+    {
+        RAM[start+end+i] = str[i];
+    }
+    heapBytesAllocated += end + str.length() - block.size;
+    block.size = end + str.length();
+    RAM[start+block.size+1] = 0;
+    return true;
+}
+
+int Memcontrol::ForkProcess(std::vector<std::string> args, Program program, bool shareCode)
+{
+    if(shareCode)
+    {
+        // the code is mapped copy-on-write, stack and data are the process' own
+        Memory code = ShareMemory(program.codeSegment.memory);
+        if(code.usedPages.size() == 0)
+            return -1;
+        program.codeSegment.memory = code;
+        program.codeSegment.startPointer = code.usedPages[0] << 12;
+        program.codeSegment.writePointer = program.codeSegment.startPointer;
+        program.dataSegment = InitSegment(0);
+        program.stackSegment = InitSegment(1);
+        program.cpuSnapshot = CpuSnapshot();
+        program.cycles = 0;
+    }
+
     Process process;
+    process.parent = -1;
     if(activeProcessId != -1)
         process.parent = processList[activeProcessId].id;
     process.name = args[0];
@@ -475,32 +1189,30 @@ int Memcontrol::ForkProcess(std::vector<std::string> args, Program program)
     process.status = 1;
     process.id = processList.size();
     if(activeProcessId != -1)
-        processList[activeProcessId].childProcesses.insert(processList[activeProcessId].childProcesses.end(), process);
-    if(process.id == -1)
     {
-        process.parent = -1;
-        process.id = 0;
+        process.nextSibling = processList[activeProcessId].firstChild;
+        processList[activeProcessId].firstChild = process.id;
     }
     process.args = args;
 
-    processList.insert(processList.end(), process);
+    processList.push_back(std::move(process));
     
-    return process.id;
+    return processList.back().id;
 }
 
 void Memcontrol::StopCurrentProcess()
 {
     processList[activeProcessId].status = 0;
-    for(auto p : processList[activeProcessId].childProcesses)
+    for(int child = processList[activeProcessId].firstChild; child != -1; child = processList[child].nextSibling)
     {
-        p.status = 2;
+        if(processList[child].status == 1)
+            processList[child].status = 2;
     }
-    activeProcessId = processList[activeProcessId].parent;
 }
 
 std::string Memcontrol::getProcessInfoString(int index)
 {
-    Process p = processList[index];
+    const Process &p = processList[index];
     std::string str;
     std::string status;
     if(p.status == 1)